@@ -0,0 +1,670 @@
+// Microbenchmarks of the hot paths of the runtime: dispatcher, rtld, arenas
+// and minilib. Linked against the runtime itself, so it runs in the same
+// freestanding environment with the same code arena setup.
+//
+// Usage: instrew-bench [prefix...]
+//
+// Runs the benchmarks whose names start with one of the prefixes, or all of
+// them. Every benchmark is run BENCH_RUNS times after a warm-up run; reported
+// are the median, minimum and maximum time per operation and the median
+// absolute deviation of the runs.
+
+#include <elf.h>
+#include <linux/mman.h>
+
+#include "common.h"
+#include "cpu-state.h"
+#include "dispatch.h"
+#include "memory.h"
+#include "rtld.h"
+#include "stats.h"
+
+#include "bench/objgen.h"
+
+#define BENCH_RUNS 15
+
+// Guest addresses of the leaf functions used for dispatching. The function at
+// BENCH_ADDR + BENCH_QTLB_ALIAS uses the same quick TLB entry as BENCH_ADDR.
+#define BENCH_ADDR 0x100000
+#define BENCH_LEAVES 1024
+#define BENCH_QTLB_ALIAS 0x4000
+// Guest addresses of objects linked by the benchmarks themselves.
+#define BENCH_ADD_BASE 0x10000000
+#define BENCH_FILL_BASE 0x40000000
+
+// Normally defined in main.c.
+char dir_path[256];
+
+// Entry points of the cdecl dispatchers, called through the PLT otherwise.
+void dispatch_cdecl(uint64_t *);
+void dispatch_cdecl_count(uint64_t *);
+
+// math.c
+double floor(double v);
+double round(double v);
+double trunc(double v);
+double fma(double x, double y, double z);
+
+// Keep the compiler from optimizing away the benchmarked operations.
+#define BENCH_USE(v) __asm__ volatile("" ::"r"(v) : "memory")
+
+static struct State bench_state;
+static struct CpuState bench_cpu_state;
+static struct DispatcherInfo bench_disp_info;
+
+static char **bench_patterns;
+static int bench_pattern_count;
+
+// Whether a benchmark with the given name or name prefix is selected.
+static bool
+bench_selected(const char *name)
+{
+    if (!bench_pattern_count)
+        return true;
+    size_t len = strlen(name);
+    for (int i = 0; i < bench_pattern_count; i++)
+    {
+        size_t plen = strlen(bench_patterns[i]);
+        if (!strncmp(name, bench_patterns[i], plen < len ? plen : len))
+            return true;
+    }
+    return false;
+}
+
+static int
+bench_compare_u64(const void *a, const void *b)
+{
+    uint64_t va = *(const uint64_t *)a, vb = *(const uint64_t *)b;
+    return va < vb ? -1 : va > vb;
+}
+
+// Format ns/op with two decimals.
+static void
+bench_format(char *buf, size_t size, uint64_t ns, size_t ops)
+{
+    uint64_t cents = (ns * 100 + ops / 2) / ops;
+    snprintf(buf, size, "%lu.%c%c", (unsigned long)(cents / 100),
+             '0' + (char)(cents / 10 % 10), '0' + (char)(cents % 10));
+}
+
+static void
+bench_measure(const char *name, size_t ops, void (*run)(void *, size_t), void *arg)
+{
+    if (!bench_selected(name))
+        return;
+
+    uint64_t times[BENCH_RUNS];
+    uint64_t devs[BENCH_RUNS];
+    run(arg, ops / 8 + 1);
+    for (size_t i = 0; i < BENCH_RUNS; i++)
+    {
+        uint64_t start = stats_now();
+        run(arg, ops);
+        times[i] = stats_now() - start;
+    }
+    qsort(times, BENCH_RUNS, sizeof(*times), bench_compare_u64);
+    uint64_t median = times[BENCH_RUNS / 2];
+    for (size_t i = 0; i < BENCH_RUNS; i++)
+        devs[i] = times[i] > median ? times[i] - median : median - times[i];
+    qsort(devs, BENCH_RUNS, sizeof(*devs), bench_compare_u64);
+
+    char med_buf[32], min_buf[32], max_buf[32], mad_buf[32];
+    bench_format(med_buf, sizeof(med_buf), median, ops);
+    bench_format(min_buf, sizeof(min_buf), times[0], ops);
+    bench_format(max_buf, sizeof(max_buf), times[BENCH_RUNS - 1], ops);
+    bench_format(mad_buf, sizeof(mad_buf), devs[BENCH_RUNS / 2], ops);
+    printf("%s: %s ns/op (min %s, max %s, mad %s; %u runs of %lu ops)\n",
+           name, med_buf, min_buf, max_buf, mad_buf, BENCH_RUNS, (unsigned long)ops);
+}
+
+static void *
+bench_buffer(size_t size)
+{
+    return mmap(NULL, ALIGN_UP(size, getpagesize()), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+}
+
+// Simple deterministic pseudo-random numbers, so that runs are comparable.
+static uint64_t bench_rand_state = 0x2545f4914f6cdd1d;
+
+static uint64_t
+bench_rand(void)
+{
+    bench_rand_state ^= bench_rand_state << 13;
+    bench_rand_state ^= bench_rand_state >> 7;
+    bench_rand_state ^= bench_rand_state << 17;
+    return bench_rand_state;
+}
+
+static int
+bench_init(void)
+{
+    struct MemConfig mem_config = {.grow_chunk = 0x100000};
+    int ret = mem_init(&mem_config);
+    if (ret < 0)
+        return ret;
+
+    bench_disp_info = dispatch_get(false, false);
+    ret = rtld_init(&bench_state.rtld, &bench_disp_info);
+    if (ret < 0)
+        return ret;
+    bench_state.stats_fd = -1;
+    bench_cpu_state.self = &bench_cpu_state;
+    bench_cpu_state.state = &bench_state;
+    set_thread_area(&bench_cpu_state);
+
+    // Leaf functions at BENCH_ADDR + 16 * i, one for every quick TLB entry,
+    // and one aliasing the first entry.
+    struct ObjgenLimits limits = {
+        .text_size = 16 * (BENCH_LEAVES + 1),
+        .syms = BENCH_LEAVES + 1,
+        .strtab_size = OBJGEN_NAME_SIZE * (BENCH_LEAVES + 1),
+    };
+    size_t size = objgen_size(&limits);
+    void *buf = bench_buffer(size);
+    if (BAD_ADDR(buf))
+        return (int)(uintptr_t)buf;
+    struct Objgen og;
+    objgen_init(&og, buf, &limits);
+    for (size_t i = 0; i <= BENCH_LEAVES; i++)
+    {
+        char name[OBJGEN_NAME_SIZE];
+        uintptr_t addr = BENCH_ADDR + (i < BENCH_LEAVES ? 16 * i : BENCH_QTLB_ALIAS);
+        objgen_name(name, 'Z', addr);
+        if (objgen_func_begin(&og, name, false) < 0 || objgen_func_end(&og) < 0)
+            return -ENOSPC;
+    }
+    size = objgen_finish(&og);
+    return rtld_add_object(&bench_state.rtld, buf, size, 0, NULL);
+}
+
+// Dispatcher: a dispatch includes the call of the (empty) target function.
+
+struct BenchDispatch
+{
+    void (*dispatch)(uint64_t *);
+};
+
+static void
+bench_run_dispatch_hit(void *arg, size_t ops)
+{
+    void (*dispatch)(uint64_t *) = ((struct BenchDispatch *)arg)->dispatch;
+    uint64_t *regs = (uint64_t *)bench_cpu_state.regdata;
+    for (size_t i = 0; i < ops; i++)
+    {
+        regs[0] = BENCH_ADDR;
+        dispatch(regs);
+    }
+}
+
+static void
+bench_run_dispatch_spread(void *arg, size_t ops)
+{
+    void (*dispatch)(uint64_t *) = ((struct BenchDispatch *)arg)->dispatch;
+    uint64_t *regs = (uint64_t *)bench_cpu_state.regdata;
+    for (size_t i = 0; i < ops; i++)
+    {
+        regs[0] = BENCH_ADDR + 16 * (i % BENCH_LEAVES);
+        dispatch(regs);
+    }
+}
+
+// Alternate between two addresses sharing a quick TLB entry, so that every
+// dispatch goes through resolve_func and finds the function in rtld.
+static void
+bench_run_dispatch_miss(void *arg, size_t ops)
+{
+    void (*dispatch)(uint64_t *) = ((struct BenchDispatch *)arg)->dispatch;
+    uint64_t *regs = (uint64_t *)bench_cpu_state.regdata;
+    for (size_t i = 0; i < ops; i++)
+    {
+        regs[0] = BENCH_ADDR + (i & 1 ? BENCH_QTLB_ALIAS : 0);
+        dispatch(regs);
+    }
+}
+
+static void
+bench_dispatch(void)
+{
+    struct BenchDispatch plain = {dispatch_cdecl};
+    struct BenchDispatch count = {dispatch_cdecl_count};
+    bench_measure("dispatch.hit", 10000000, bench_run_dispatch_hit, &plain);
+    bench_measure("dispatch.hit_spread", 10000000, bench_run_dispatch_spread, &plain);
+    bench_measure("dispatch.hit_count", 10000000, bench_run_dispatch_hit, &count);
+    bench_measure("dispatch.miss", 1000000, bench_run_dispatch_miss, &plain);
+}
+
+// rtld_add_object for objects with a single function containing a number of
+// calls, cycling through calls within the object, calls to an already linked
+// guest function and calls into the PLT.
+
+struct BenchAdd
+{
+    void *obj;
+    size_t size;
+    uint64_t skew;
+};
+
+static void
+bench_run_add(void *arg, size_t ops)
+{
+    struct BenchAdd *add = arg;
+    for (size_t i = 0; i < ops; i++)
+    {
+        int ret = rtld_add_object(&bench_state.rtld, add->obj, add->size, add->skew, NULL);
+        if (ret < 0)
+        {
+            dprintf(2, "error: rtld_add_object failed: %u\n", -ret);
+            _exit(1);
+        }
+        add->skew += 16;
+    }
+}
+
+static int
+bench_add_prepare(struct BenchAdd *add, size_t relocs)
+{
+    struct ObjgenLimits limits = {
+        .text_size = 64 + 16 * relocs,
+        .syms = 3,
+        .relas = relocs,
+        .strtab_size = 3 * OBJGEN_NAME_SIZE,
+    };
+    add->obj = bench_buffer(objgen_size(&limits));
+    if (BAD_ADDR(add->obj))
+        return (int)(uintptr_t)add->obj;
+
+    struct Objgen og;
+    objgen_init(&og, add->obj, &limits);
+    char name[OBJGEN_NAME_SIZE];
+    objgen_name(name, 'Z', BENCH_ADDR);
+    size_t guest = objgen_undef(&og, name);
+    size_t plt = objgen_undef(&og, "syscall");
+    objgen_name(name, 'S', 0);
+    if (!guest || !plt || objgen_func_begin(&og, name, true) < 0)
+        return -ENOSPC;
+    for (size_t i = 0; i < relocs; i++)
+    {
+        size_t sym = i % 3 == 0 ? OBJGEN_SYM_TEXT : i % 3 == 1 ? guest : plt;
+        if (objgen_func_call(&og, sym, 0) < 0)
+            return -ENOSPC;
+    }
+    if (objgen_func_end(&og) < 0)
+        return -ENOSPC;
+    add->size = objgen_finish(&og);
+    add->skew = BENCH_ADD_BASE + (relocs << 20);
+    return 0;
+}
+
+static void
+bench_rtld_add(void)
+{
+    static const size_t relocs[] = {0, 16, 256, 4096};
+    static const size_t ops[] = {500, 500, 100, 10};
+    for (size_t i = 0; i < sizeof(relocs) / sizeof(*relocs); i++)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "rtld.add.relocs%lu", (unsigned long)relocs[i]);
+        if (!bench_selected(name))
+            continue;
+        struct BenchAdd add;
+        if (bench_add_prepare(&add, relocs[i]) < 0)
+        {
+            dprintf(2, "error: failed to build object\n");
+            _exit(1);
+        }
+        bench_measure(name, ops[i], bench_run_add, &add);
+    }
+}
+
+// rtld_patch of a call site, as done for every patchable dispatcher miss.
+
+struct BenchPatch
+{
+    struct RtldPatchData patch_data;
+    void *targets[2];
+};
+
+static void
+bench_run_patch(void *arg, size_t ops)
+{
+    struct BenchPatch *patch = arg;
+    for (size_t i = 0; i < ops; i++)
+    {
+        rtld_patch(&patch->patch_data, patch->targets[i & 1]);
+        mem_flush_code();
+    }
+}
+
+static void
+bench_rtld_patch(void)
+{
+    if (!bench_selected("rtld.patch"))
+        return;
+    struct BenchPatch patch;
+    if (rtld_resolve(&bench_state.rtld, BENCH_ADDR, &patch.targets[0]) < 0 ||
+        rtld_resolve(&bench_state.rtld, BENCH_ADDR + 16, &patch.targets[1]) < 0)
+        _exit(1);
+    uint8_t *site = mem_alloc_code(16, 16);
+    if (BAD_ADDR(site))
+        _exit(1);
+#if defined(__x86_64__)
+    static const uint8_t call[16] = {0xe8}; // call rel32
+    mem_write_code(site, call, sizeof(call));
+    patch.patch_data = (struct RtldPatchData){
+        .rel_type = R_X86_64_PLT32,
+        .rel_size = 8,
+        .addend = -4,
+        .patch_addr = (uintptr_t)site + 1,
+    };
+#elif defined(__aarch64__)
+    static const uint32_t call[4] = {0x94000000}; // bl
+    mem_write_code(site, call, sizeof(call));
+    patch.patch_data = (struct RtldPatchData){
+        .rel_type = R_AARCH64_CALL26,
+        .rel_size = 8,
+        .patch_addr = (uintptr_t)site,
+    };
+#endif
+    bench_measure("rtld.patch", 1000000, bench_run_patch, &patch);
+}
+
+// rtld_resolve at increasing load of the guest address table. The table is
+// filled with objects of BENCH_FILL_FUNCS functions at irregular distances,
+// placed back to back like the code of a large guest binary.
+
+#define BENCH_FILL_FUNCS 1024
+#define BENCH_LOOKUPS 4096
+
+struct BenchResolve
+{
+    uintptr_t addrs[BENCH_LOOKUPS];
+};
+
+static void
+bench_run_resolve(void *arg, size_t ops)
+{
+    struct BenchResolve *resolve = arg;
+    for (size_t i = 0; i < ops; i++)
+    {
+        void *entry = NULL;
+        rtld_resolve(&bench_state.rtld, resolve->addrs[i % BENCH_LOOKUPS], &entry);
+        BENCH_USE(entry);
+    }
+}
+
+static void
+bench_rtld_resolve(void)
+{
+    if (!bench_selected("rtld.resolve"))
+        return;
+
+    struct ObjgenLimits limits = {
+        .text_size = 16 * BENCH_FILL_FUNCS,
+        .syms = BENCH_FILL_FUNCS,
+        .strtab_size = OBJGEN_NAME_SIZE * BENCH_FILL_FUNCS,
+    };
+    size_t size = objgen_size(&limits);
+    void *obj = bench_buffer(size);
+    uint64_t *offsets = bench_buffer(BENCH_FILL_FUNCS * sizeof(uint64_t));
+    static struct BenchResolve hits, misses;
+    if (BAD_ADDR(obj) || BAD_ADDR(offsets))
+        _exit(1);
+    struct Objgen og;
+    objgen_init(&og, obj, &limits);
+    uint64_t offset = 0;
+    for (size_t i = 0; i < BENCH_FILL_FUNCS; i++)
+    {
+        char name[OBJGEN_NAME_SIZE];
+        offsets[i] = offset;
+        objgen_name(name, 'S', offset);
+        if (objgen_func_begin(&og, name, false) < 0 || objgen_func_end(&og) < 0)
+            _exit(1);
+        offset += 16 * (1 + bench_rand() % 16);
+    }
+    uint64_t span = offset;
+    size = objgen_finish(&og);
+
+    static const unsigned loads[] = {12, 50, 75}; // percent
+    size_t objects = 0;
+    for (size_t l = 0; l < sizeof(loads) / sizeof(*loads); l++)
+    {
+        size_t target = ((size_t)1 << RTLD_HASH_BITS) * loads[l] / 100;
+        while (bench_state.rtld.stats.functions + BENCH_FILL_FUNCS <= target)
+        {
+            uint64_t skew = BENCH_FILL_BASE + objects * span;
+            int ret = rtld_add_object(&bench_state.rtld, obj, size, skew, NULL);
+            if (ret < 0)
+            {
+                dprintf(2, "error: rtld_add_object failed: %u\n", -ret);
+                _exit(1);
+            }
+            objects++;
+        }
+        if (!objects)
+            continue;
+
+        // Random functions of the filled objects; misses are between them.
+        for (size_t i = 0; i < BENCH_LOOKUPS; i++)
+        {
+            uint64_t skew = BENCH_FILL_BASE + bench_rand() % objects * span;
+            hits.addrs[i] = skew + offsets[bench_rand() % BENCH_FILL_FUNCS];
+            misses.addrs[i] = hits.addrs[i] + 8;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "rtld.resolve.load%u.hit", loads[l]);
+        bench_measure(name, 1000000, bench_run_resolve, &hits);
+        snprintf(name, sizeof(name), "rtld.resolve.load%u.miss", loads[l]);
+        bench_measure(name, 1000000, bench_run_resolve, &misses);
+    }
+}
+
+// Arenas: object code and read-only data are served directly by arena_alloc,
+// patch stubs from stub blocks.
+
+static void
+bench_run_alloc_code(void *arg, size_t ops)
+{
+    size_t size = (uintptr_t)arg;
+    for (size_t i = 0; i < ops; i++)
+        BENCH_USE(mem_alloc_code(size, 16));
+}
+
+static void
+bench_run_alloc_stub(void *arg, size_t ops)
+{
+    size_t size = (uintptr_t)arg;
+    for (size_t i = 0; i < ops; i++)
+        BENCH_USE(mem_alloc_stub(size, 16));
+}
+
+static void
+bench_run_alloc_rodata(void *arg, size_t ops)
+{
+    size_t size = (uintptr_t)arg;
+    for (size_t i = 0; i < ops; i++)
+        BENCH_USE(mem_alloc_rodata(size, 8));
+}
+
+struct BenchWrite
+{
+    void *dst;
+    const void *src;
+    size_t size;
+};
+
+static void
+bench_run_write_code(void *arg, size_t ops)
+{
+    struct BenchWrite *write = arg;
+    for (size_t i = 0; i < ops; i++)
+    {
+        mem_write_code(write->dst, write->src, write->size);
+        mem_flush_code();
+    }
+}
+
+static void
+bench_mem(void)
+{
+    bench_measure("mem.alloc_code.32", 100000, bench_run_alloc_code, (void *)32);
+    bench_measure("mem.alloc_code.512", 10000, bench_run_alloc_code, (void *)512);
+    bench_measure("mem.alloc_stub.48", 100000, bench_run_alloc_stub, (void *)48);
+    bench_measure("mem.alloc_rodata.64", 50000, bench_run_alloc_rodata, (void *)64);
+
+    if (!bench_selected("mem.write_code"))
+        return;
+    static const size_t sizes[] = {64, 4096};
+    void *src = bench_buffer(4096);
+    void *dst = mem_alloc_code(4096, 64);
+    if (BAD_ADDR(src) || BAD_ADDR(dst))
+        _exit(1);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "mem.write_code.%lu", (unsigned long)sizes[i]);
+        struct BenchWrite write = {dst, src, sizes[i]};
+        bench_measure(name, 100000, bench_run_write_code, &write);
+    }
+}
+
+// minilib string functions and math.c.
+
+static char bench_str_a[4096];
+static char bench_str_b[4096];
+
+static void
+bench_run_memcpy(void *arg, size_t ops)
+{
+    size_t size = (uintptr_t)arg;
+    for (size_t i = 0; i < ops; i++)
+    {
+        memcpy(bench_str_a, bench_str_b, size);
+        BENCH_USE(bench_str_a);
+    }
+}
+
+static void
+bench_run_memset(void *arg, size_t ops)
+{
+    size_t size = (uintptr_t)arg;
+    for (size_t i = 0; i < ops; i++)
+    {
+        memset(bench_str_a, (int)i, size);
+        BENCH_USE(bench_str_a);
+    }
+}
+
+static void
+bench_run_memcmp(void *arg, size_t ops)
+{
+    size_t size = (uintptr_t)arg;
+    for (size_t i = 0; i < ops; i++)
+        BENCH_USE(memcmp(bench_str_a, bench_str_b, size));
+}
+
+static void
+bench_run_strlen(void *arg, size_t ops)
+{
+    (void)arg;
+    for (size_t i = 0; i < ops; i++)
+        BENCH_USE(strlen(bench_str_a));
+}
+
+static void
+bench_run_strcmp(void *arg, size_t ops)
+{
+    (void)arg;
+    for (size_t i = 0; i < ops; i++)
+        BENCH_USE(strcmp(bench_str_a, bench_str_b));
+}
+
+// The file name of an object in the cache, as built on every load.
+static void
+bench_run_snprintf(void *arg, size_t ops)
+{
+    (void)arg;
+    for (size_t i = 0; i < ops; i++)
+    {
+        snprintf(bench_str_a, sizeof(bench_str_a), "%s%lx",
+                 "/tmp/instrew-cache/0123456789abcdef/", (unsigned long)(0x401000 + i));
+        BENCH_USE(bench_str_a);
+    }
+}
+
+static double bench_values[64];
+
+struct BenchMath
+{
+    double (*func)(double);
+};
+
+static void
+bench_run_math(void *arg, size_t ops)
+{
+    double (*func)(double) = ((struct BenchMath *)arg)->func;
+    for (size_t i = 0; i < ops; i++)
+    {
+        double v = func(bench_values[i % 64]);
+        __asm__ volatile("" ::"m"(v));
+    }
+}
+
+static void
+bench_run_fma(void *arg, size_t ops)
+{
+    (void)arg;
+    for (size_t i = 0; i < ops; i++)
+    {
+        double v = fma(bench_values[i % 64], bench_values[(i + 1) % 64], 0.5);
+        __asm__ volatile("" ::"m"(v));
+    }
+}
+
+static void
+bench_minilib(void)
+{
+    memset(bench_str_b, 'x', sizeof(bench_str_b) - 1);
+    memcpy(bench_str_a, bench_str_b, sizeof(bench_str_a));
+    bench_str_a[32] = bench_str_b[32] = '\0';
+    for (size_t i = 0; i < 64; i++)
+        bench_values[i] = ((double)bench_rand() / (double)UINT64_MAX - 0.5) * 1e6;
+
+    // The comparisons need equal 32-byte strings, the copies clobber them.
+    bench_measure("minilib.memcmp.32", 1000000, bench_run_memcmp, (void *)32);
+    bench_measure("minilib.strlen.32", 1000000, bench_run_strlen, NULL);
+    bench_measure("minilib.strcmp.32", 1000000, bench_run_strcmp, NULL);
+    bench_measure("minilib.memcpy.16", 10000000, bench_run_memcpy, (void *)16);
+    bench_measure("minilib.memcpy.256", 1000000, bench_run_memcpy, (void *)256);
+    bench_measure("minilib.memcpy.4096", 100000, bench_run_memcpy, (void *)4096);
+    bench_measure("minilib.memset.4096", 100000, bench_run_memset, (void *)4096);
+    bench_measure("minilib.snprintf.path", 100000, bench_run_snprintf, NULL);
+    struct BenchMath math_floor = {floor}, math_round = {round}, math_trunc = {trunc};
+    bench_measure("math.floor", 10000000, bench_run_math, &math_floor);
+    bench_measure("math.round", 10000000, bench_run_math, &math_round);
+    bench_measure("math.trunc", 10000000, bench_run_math, &math_trunc);
+    bench_measure("math.fma", 10000000, bench_run_fma, NULL);
+}
+
+int main(int argc, char **argv)
+{
+    bench_patterns = argv + 1;
+    bench_pattern_count = argc - 1;
+
+    int ret = bench_init();
+    if (ret < 0)
+    {
+        dprintf(2, "error: failed to set up runtime: %u\n", -ret);
+        return 1;
+    }
+
+    bench_dispatch();
+    // Fills most of the guest address table, so run it before anything else
+    // adds functions.
+    bench_rtld_resolve();
+    bench_rtld_add();
+    bench_rtld_patch();
+    bench_mem();
+    bench_minilib();
+    return 0;
+}
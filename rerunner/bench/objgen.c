@@ -0,0 +1,463 @@
+#include "objgen.h"
+
+// Only builtins are used, which keeps this usable both in the freestanding
+// runtime and in hosted tools.
+#define objgen_memcpy __builtin_memcpy
+#define objgen_memset __builtin_memset
+#define objgen_strlen __builtin_strlen
+
+#define OBJGEN_ALIGN(v, a) (((v) + ((a)-1)) & ~((size_t)(a)-1))
+
+#if defined(__x86_64__)
+#define OBJGEN_MACHINE EM_X86_64
+#define OBJGEN_FUNC_PAD 0xcc // int3
+#elif defined(__aarch64__)
+#define OBJGEN_MACHINE EM_AARCH64
+#define OBJGEN_FUNC_PAD 0x00 // udf
+#else
+#error "currently unsupported architecture"
+#endif
+
+enum
+{
+    OBJGEN_SHNDX_TEXT = 1,
+    OBJGEN_SHNDX_RODATA,
+    OBJGEN_SHNDX_RELA,
+    OBJGEN_SHNDX_SYMTAB,
+    OBJGEN_SHNDX_STRTAB,
+    OBJGEN_SHNDX_SHSTRTAB,
+    OBJGEN_SHNUM,
+};
+
+static const char objgen_shstrtab[] =
+    "\0.text\0.rodata\0.rela.text\0.symtab\0.strtab\0.shstrtab";
+// Offsets of the names in objgen_shstrtab.
+static const unsigned objgen_shnames[OBJGEN_SHNUM] = {0, 1, 7, 15, 26, 34, 42};
+
+// Offsets of the parts of the object; the section headers come last.
+struct ObjgenLayout
+{
+    size_t text;
+    size_t rodata;
+    size_t rela;
+    size_t symtab;
+    size_t strtab;
+    size_t shstrtab;
+    size_t shdr;
+    size_t size;
+};
+
+static void
+objgen_layout(const struct ObjgenLimits *limits, struct ObjgenLayout *l)
+{
+    l->text = OBJGEN_ALIGN(sizeof(Elf64_Ehdr), 16);
+    l->rodata = OBJGEN_ALIGN(l->text + limits->text_size, 16);
+    l->rela = OBJGEN_ALIGN(l->rodata + limits->rodata_size, 8);
+    l->symtab = l->rela + limits->relas * sizeof(Elf64_Rela);
+    l->strtab = l->symtab + (limits->syms + 3) * sizeof(Elf64_Sym);
+    l->shstrtab = l->strtab + limits->strtab_size + 1;
+    l->shdr = OBJGEN_ALIGN(l->shstrtab + sizeof(objgen_shstrtab), 8);
+    l->size = l->shdr + OBJGEN_SHNUM * sizeof(Elf64_Shdr);
+}
+
+void objgen_name(char *buf, char prefix, uint64_t addr)
+{
+    char digits[OBJGEN_NAME_SIZE];
+    size_t count = 0;
+    do
+        digits[count++] = '0' + (addr & 7);
+    while (addr >>= 3);
+    *buf++ = prefix;
+    while (count)
+        *buf++ = digits[--count];
+    *buf = '\0';
+}
+
+size_t objgen_size(const struct ObjgenLimits *limits)
+{
+    struct ObjgenLayout l;
+    objgen_layout(limits, &l);
+    return l.size;
+}
+
+void objgen_init(struct Objgen *og, void *buf, const struct ObjgenLimits *limits)
+{
+    struct ObjgenLayout l;
+    objgen_layout(limits, &l);
+    objgen_memset(buf, 0, l.size);
+
+    og->base = buf;
+    og->ehdr = buf;
+    og->shdr = (Elf64_Shdr *)(og->base + l.shdr);
+    og->text = og->base + l.text;
+    og->rodata = og->base + l.rodata;
+    og->relas = (Elf64_Rela *)(og->base + l.rela);
+    og->syms = (Elf64_Sym *)(og->base + l.symtab);
+    og->strtab = (char *)og->base + l.strtab;
+    og->limits = *limits;
+    og->text_size = 0;
+    og->rodata_size = 0;
+    og->rela_count = 0;
+    og->strtab_size = 1; // empty name
+    og->func_sym = 0;
+    og->func_frame = false;
+
+    og->syms[OBJGEN_SYM_TEXT].st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+    og->syms[OBJGEN_SYM_TEXT].st_shndx = OBJGEN_SHNDX_TEXT;
+    og->syms[OBJGEN_SYM_RODATA].st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+    og->syms[OBJGEN_SYM_RODATA].st_shndx = OBJGEN_SHNDX_RODATA;
+    og->sym_count = 3;
+    objgen_memcpy(og->base + l.shstrtab, objgen_shstrtab, sizeof(objgen_shstrtab));
+
+    Elf64_Shdr *shdr = og->shdr;
+    shdr[OBJGEN_SHNDX_TEXT] = (Elf64_Shdr){
+        .sh_name = objgen_shnames[OBJGEN_SHNDX_TEXT], .sh_type = SHT_PROGBITS,
+        .sh_flags = SHF_ALLOC | SHF_EXECINSTR, .sh_offset = l.text,
+        .sh_addralign = 16,
+    };
+    shdr[OBJGEN_SHNDX_RODATA] = (Elf64_Shdr){
+        .sh_name = objgen_shnames[OBJGEN_SHNDX_RODATA], .sh_type = SHT_PROGBITS,
+        .sh_flags = SHF_ALLOC, .sh_offset = l.rodata, .sh_addralign = 16,
+    };
+    shdr[OBJGEN_SHNDX_RELA] = (Elf64_Shdr){
+        .sh_name = objgen_shnames[OBJGEN_SHNDX_RELA], .sh_type = SHT_RELA,
+        .sh_flags = SHF_INFO_LINK, .sh_offset = l.rela,
+        .sh_link = OBJGEN_SHNDX_SYMTAB, .sh_info = OBJGEN_SHNDX_TEXT,
+        .sh_addralign = 8, .sh_entsize = sizeof(Elf64_Rela),
+    };
+    shdr[OBJGEN_SHNDX_SYMTAB] = (Elf64_Shdr){
+        .sh_name = objgen_shnames[OBJGEN_SHNDX_SYMTAB], .sh_type = SHT_SYMTAB,
+        .sh_offset = l.symtab, .sh_link = OBJGEN_SHNDX_STRTAB,
+        .sh_info = 3, // first global symbol
+        .sh_addralign = 8, .sh_entsize = sizeof(Elf64_Sym),
+    };
+    shdr[OBJGEN_SHNDX_STRTAB] = (Elf64_Shdr){
+        .sh_name = objgen_shnames[OBJGEN_SHNDX_STRTAB], .sh_type = SHT_STRTAB,
+        .sh_offset = l.strtab, .sh_addralign = 1,
+    };
+    shdr[OBJGEN_SHNDX_SHSTRTAB] = (Elf64_Shdr){
+        .sh_name = objgen_shnames[OBJGEN_SHNDX_SHSTRTAB], .sh_type = SHT_STRTAB,
+        .sh_offset = l.shstrtab, .sh_size = sizeof(objgen_shstrtab),
+        .sh_addralign = 1,
+    };
+}
+
+static size_t
+objgen_sym(struct Objgen *og, const char *name)
+{
+    size_t len = objgen_strlen(name) + 1;
+    if (og->sym_count == og->limits.syms + 3 ||
+        og->strtab_size + len > og->limits.strtab_size + 1)
+        return 0;
+    Elf64_Sym *sym = &og->syms[og->sym_count];
+    sym->st_name = og->strtab_size;
+    sym->st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+    sym->st_shndx = SHN_UNDEF;
+    objgen_memcpy(og->strtab + og->strtab_size, name, len);
+    og->strtab_size += len;
+    return og->sym_count++;
+}
+
+size_t objgen_undef(struct Objgen *og, const char *name)
+{
+    return objgen_sym(og, name);
+}
+
+ptrdiff_t objgen_rodata(struct Objgen *og, const void *data, size_t size)
+{
+    size_t off = OBJGEN_ALIGN(og->rodata_size, 8);
+    if (off + size > og->limits.rodata_size)
+        return -1;
+    objgen_memcpy(og->rodata + off, data, size);
+    og->rodata_size = off + size;
+    return off;
+}
+
+static int
+objgen_emit(struct Objgen *og, const void *code, size_t size)
+{
+    if (og->text_size + size > og->limits.text_size)
+        return -1;
+    objgen_memcpy(og->text + og->text_size, code, size);
+    og->text_size += size;
+    return 0;
+}
+
+#if defined(__aarch64__)
+static int
+objgen_emit32(struct Objgen *og, uint32_t insn)
+{
+    return objgen_emit(og, &insn, sizeof(insn));
+}
+#endif
+
+// Relocate the instruction bytes at offset off from the end of the text.
+static int
+objgen_rela(struct Objgen *og, size_t off, unsigned type, size_t sym, int64_t addend)
+{
+    if (og->rela_count == og->limits.relas)
+        return -1;
+    og->relas[og->rela_count++] = (Elf64_Rela){
+        .r_offset = og->text_size - off,
+        .r_info = ELF64_R_INFO(sym, type),
+        .r_addend = addend,
+    };
+    return 0;
+}
+
+int objgen_func_begin(struct Objgen *og, const char *name, bool frame)
+{
+    if (og->func_sym)
+        return -1;
+    size_t start = OBJGEN_ALIGN(og->text_size, 16);
+    if (start > og->limits.text_size)
+        return -1;
+    objgen_memset(og->text + og->text_size, OBJGEN_FUNC_PAD, start - og->text_size);
+    og->text_size = start;
+
+    size_t sym = objgen_sym(og, name);
+    if (!sym)
+        return -1;
+    og->syms[sym].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+    og->syms[sym].st_shndx = OBJGEN_SHNDX_TEXT;
+    og->syms[sym].st_value = start;
+    og->func_sym = sym;
+    og->func_frame = frame;
+    if (!frame)
+        return 0;
+
+    // Keep the register file pointer in a callee-saved register.
+#if defined(__x86_64__)
+    static const uint8_t prologue[] = {
+        0x53,             // push rbx
+        0x48, 0x89, 0xfb, // mov rbx, rdi
+    };
+    return objgen_emit(og, prologue, sizeof(prologue));
+#elif defined(__aarch64__)
+    static const uint32_t prologue[] = {
+        0xa9be7bfd, // stp x29, x30, [sp, -32]!
+        0x910003fd, // mov x29, sp
+        0xf9000bf3, // str x19, [sp, 16]
+        0xaa0003f3, // mov x19, x0
+    };
+    return objgen_emit(og, prologue, sizeof(prologue));
+#endif
+}
+
+int objgen_func_call(struct Objgen *og, size_t sym, int64_t addend)
+{
+    if (!og->func_sym || !og->func_frame)
+        return -1;
+#if defined(__x86_64__)
+    static const uint8_t call[] = {
+        0x48, 0x89, 0xdf,       // mov rdi, rbx
+        0xe8, 0, 0, 0, 0,       // call sym
+    };
+    if (objgen_emit(og, call, sizeof(call)) < 0)
+        return -1;
+    return objgen_rela(og, 4, R_X86_64_PLT32, sym, addend - 4);
+#elif defined(__aarch64__)
+    if (objgen_emit32(og, 0xaa1303e0) < 0 || // mov x0, x19
+        objgen_emit32(og, 0x94000000) < 0)   // bl sym
+        return -1;
+    return objgen_rela(og, 4, R_AARCH64_CALL26, sym, addend);
+#endif
+}
+
+// Register of the function holding the guest register file.
+#if defined(__x86_64__)
+#define OBJGEN_REGS_MODRM(og) ((og)->func_frame ? 0x83 : 0x87) // [rbx+d32] or [rdi+d32]
+#elif defined(__aarch64__)
+#define OBJGEN_REGS_RN(og) ((og)->func_frame ? 19u : 0u)      // x19 or x0
+#endif
+
+int objgen_func_set_reg(struct Objgen *og, unsigned reg, uint64_t value)
+{
+    if (!og->func_sym)
+        return -1;
+#if defined(__x86_64__)
+    uint8_t code[17] = {0x48, 0xb8}; // movabs rax, value
+    objgen_memcpy(code + 2, &value, sizeof(value));
+    code[10] = 0x48; // mov [regs + 8*reg], rax
+    code[11] = 0x89;
+    code[12] = OBJGEN_REGS_MODRM(og);
+    uint32_t disp = reg * 8;
+    objgen_memcpy(code + 13, &disp, sizeof(disp));
+    return objgen_emit(og, code, sizeof(code));
+#elif defined(__aarch64__)
+    if (reg >= 4096)
+        return -1;
+    for (unsigned i = 0; i < 4; i++) // movz/movk x16, ..., lsl 16*i
+    {
+        uint32_t imm = (value >> (16 * i)) & 0xffff;
+        if (objgen_emit32(og, (i ? 0xf2800010 : 0xd2800010) | (i << 21) | (imm << 5)) < 0)
+            return -1;
+    }
+    // str x16, [regs, 8*reg]
+    return objgen_emit32(og, 0xf9000010 | (reg << 10) | (OBJGEN_REGS_RN(og) << 5));
+#endif
+}
+
+int objgen_func_set_pc(struct Objgen *og, uint64_t addr)
+{
+    return objgen_func_set_reg(og, 0, addr);
+}
+
+int objgen_func_add_reg(struct Objgen *og, unsigned reg, int8_t imm)
+{
+    if (!og->func_sym)
+        return -1;
+#if defined(__x86_64__)
+    uint8_t code[8] = {0x48, 0x83, OBJGEN_REGS_MODRM(og)}; // add qword [regs + 8*reg], imm
+    uint32_t disp = reg * 8;
+    objgen_memcpy(code + 3, &disp, sizeof(disp));
+    code[7] = imm;
+    return objgen_emit(og, code, sizeof(code));
+#elif defined(__aarch64__)
+    if (reg >= 4096)
+        return -1;
+    uint32_t rn = OBJGEN_REGS_RN(og) << 5;
+    uint32_t add = imm >= 0 ? 0x91000210 | ((uint32_t)imm << 10)       // add x16, x16, imm
+                            : 0xd1000210 | ((uint32_t)-imm << 10);     // sub x16, x16, -imm
+    if (objgen_emit32(og, 0xf9400010 | (reg << 10) | rn) < 0 || // ldr x16, [regs, 8*reg]
+        objgen_emit32(og, add) < 0)
+        return -1;
+    return objgen_emit32(og, 0xf9000010 | (reg << 10) | rn); // str x16, [regs, 8*reg]
+#endif
+}
+
+ptrdiff_t objgen_func_cold_begin(struct Objgen *og)
+{
+    if (!og->func_sym)
+        return -1;
+#if defined(__x86_64__)
+    static const uint8_t jmp[] = {0xe9, 0, 0, 0, 0}; // jmp end
+    if (objgen_emit(og, jmp, sizeof(jmp)) < 0)
+        return -1;
+#elif defined(__aarch64__)
+    if (objgen_emit32(og, 0x14000000) < 0) // b end
+        return -1;
+#endif
+    return og->text_size;
+}
+
+int objgen_func_cold_end(struct Objgen *og, ptrdiff_t cold)
+{
+    if (!og->func_sym || cold < 0)
+        return -1;
+    int32_t delta = og->text_size - cold;
+#if defined(__x86_64__)
+    objgen_memcpy(og->text + cold - 4, &delta, sizeof(delta));
+#elif defined(__aarch64__)
+    uint32_t insn = 0x14000000 | (((uint32_t)(delta + 4) >> 2) & 0x3ffffff);
+    objgen_memcpy(og->text + cold - 4, &insn, sizeof(insn));
+#endif
+    return 0;
+}
+
+int objgen_func_ref(struct Objgen *og, size_t sym, int64_t addend)
+{
+    if (!og->func_sym)
+        return -1;
+#if defined(__x86_64__)
+    static const uint8_t lea[] = {0x48, 0x8d, 0x05, 0, 0, 0, 0}; // lea rax, [rip+sym]
+    if (objgen_emit(og, lea, sizeof(lea)) < 0)
+        return -1;
+    return objgen_rela(og, 4, R_X86_64_PC32, sym, addend - 4);
+#elif defined(__aarch64__)
+    if (objgen_emit32(og, 0x90000001) < 0) // adrp x1, sym
+        return -1;
+    if (objgen_rela(og, 4, R_AARCH64_ADR_PREL_PG_HI21, sym, addend) < 0)
+        return -1;
+    if (objgen_emit32(og, 0x91000021) < 0) // add x1, x1, :lo12:sym
+        return -1;
+    return objgen_rela(og, 4, R_AARCH64_ADD_ABS_LO12_NC, sym, addend);
+#endif
+}
+
+static int
+objgen_func_close(struct Objgen *og)
+{
+    Elf64_Sym *sym = &og->syms[og->func_sym];
+    sym->st_size = og->text_size - sym->st_value;
+    og->func_sym = 0;
+    return 0;
+}
+
+int objgen_func_end(struct Objgen *og)
+{
+    if (!og->func_sym)
+        return -1;
+#if defined(__x86_64__)
+    static const uint8_t epilogue[] = {
+        0x5b, // pop rbx
+        0xc3, // ret
+    };
+    int ret = og->func_frame ? objgen_emit(og, epilogue, sizeof(epilogue))
+                             : objgen_emit(og, epilogue + 1, 1);
+#elif defined(__aarch64__)
+    static const uint32_t epilogue[] = {
+        0xf9400bf3, // ldr x19, [sp, 16]
+        0xa8c27bfd, // ldp x29, x30, [sp], 32
+        0xd65f03c0, // ret
+    };
+    int ret = og->func_frame ? objgen_emit(og, epilogue, sizeof(epilogue))
+                             : objgen_emit(og, epilogue + 2, sizeof(uint32_t));
+#endif
+    if (ret < 0)
+        return ret;
+    return objgen_func_close(og);
+}
+
+int objgen_func_end_tail(struct Objgen *og, size_t sym, int64_t addend)
+{
+    if (!og->func_sym)
+        return -1;
+#if defined(__x86_64__)
+    static const uint8_t epilogue[] = {
+        0x48, 0x89, 0xdf, // mov rdi, rbx
+        0x5b,             // pop rbx
+        0xe9, 0, 0, 0, 0, // jmp sym
+    };
+    int ret = og->func_frame ? objgen_emit(og, epilogue, sizeof(epilogue))
+                             : objgen_emit(og, epilogue + 4, 5);
+    if (ret < 0 || objgen_rela(og, 4, R_X86_64_PLT32, sym, addend - 4) < 0)
+        return -1;
+#elif defined(__aarch64__)
+    static const uint32_t epilogue[] = {
+        0xaa1303e0, // mov x0, x19
+        0xf9400bf3, // ldr x19, [sp, 16]
+        0xa8c27bfd, // ldp x29, x30, [sp], 32
+        0x14000000, // b sym
+    };
+    int ret = og->func_frame ? objgen_emit(og, epilogue, sizeof(epilogue))
+                             : objgen_emit(og, epilogue + 3, sizeof(uint32_t));
+    if (ret < 0 || objgen_rela(og, 4, R_AARCH64_JUMP26, sym, addend) < 0)
+        return -1;
+#endif
+    return objgen_func_close(og);
+}
+
+size_t objgen_finish(struct Objgen *og)
+{
+    Elf64_Ehdr *ehdr = og->ehdr;
+    objgen_memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+    ehdr->e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr->e_type = ET_REL;
+    ehdr->e_machine = OBJGEN_MACHINE;
+    ehdr->e_version = EV_CURRENT;
+    ehdr->e_shoff = (uint8_t *)og->shdr - og->base;
+    ehdr->e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr->e_shentsize = sizeof(Elf64_Shdr);
+    ehdr->e_shnum = OBJGEN_SHNUM;
+    ehdr->e_shstrndx = OBJGEN_SHNDX_SHSTRTAB;
+
+    og->shdr[OBJGEN_SHNDX_TEXT].sh_size = og->text_size;
+    og->shdr[OBJGEN_SHNDX_RODATA].sh_size = og->rodata_size;
+    og->shdr[OBJGEN_SHNDX_RELA].sh_size = og->rela_count * sizeof(Elf64_Rela);
+    og->shdr[OBJGEN_SHNDX_SYMTAB].sh_size = og->sym_count * sizeof(Elf64_Sym);
+    og->shdr[OBJGEN_SHNDX_STRTAB].sh_size = og->strtab_size;
+    return ehdr->e_shoff + OBJGEN_SHNUM * sizeof(Elf64_Shdr);
+}
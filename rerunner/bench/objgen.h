@@ -0,0 +1,98 @@
+#ifndef _INSTREW_RUNNER_OBJGEN_H
+#define _INSTREW_RUNNER_OBJGEN_H
+
+#include <elf.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Builder for relocatable objects of the host ISA in the shape produced by
+// instrew: global functions named Z<octal guest address> (or S<octal offset>
+// for addresses relative to the load base), calls to other guest functions
+// and to the PLT, and references to read-only data.
+//
+// The builder works on a caller-provided buffer and needs nothing but memory,
+// so that it can be used inside the runtime as well as by hosted tools. The
+// layout is fixed when the builder is initialized, therefore upper bounds of
+// the section sizes have to be given up front.
+
+struct ObjgenLimits
+{
+    size_t text_size;
+    size_t rodata_size;
+    size_t syms;  // excluding the null and section symbols
+    size_t relas;
+    size_t strtab_size;
+};
+
+struct Objgen
+{
+    uint8_t *base;
+    Elf64_Ehdr *ehdr;
+    Elf64_Shdr *shdr;
+    uint8_t *text;
+    uint8_t *rodata;
+    Elf64_Rela *relas;
+    Elf64_Sym *syms;
+    char *strtab;
+
+    struct ObjgenLimits limits;
+    size_t text_size;
+    size_t rodata_size;
+    size_t rela_count;
+    size_t sym_count;
+    size_t strtab_size;
+
+    // Function currently being emitted, 0 if none.
+    size_t func_sym;
+    // Whether the current function needs a frame, i.e. contains calls.
+    bool func_frame;
+};
+
+// Symbol indices of the section symbols, usable as relocation targets.
+#define OBJGEN_SYM_TEXT 1
+#define OBJGEN_SYM_RODATA 2
+
+// Name of a function at a guest address with prefix Z (absolute) or S
+// (relative to the load base).
+#define OBJGEN_NAME_SIZE 24
+void objgen_name(char *buf, char prefix, uint64_t addr);
+
+// Buffer size needed for objects within the limits.
+size_t objgen_size(const struct ObjgenLimits *limits);
+void objgen_init(struct Objgen *og, void *buf, const struct ObjgenLimits *limits);
+
+// Add an undefined symbol, e.g. Z401000 or syscall. Returns the symbol index
+// or 0 if the limits are exhausted.
+size_t objgen_undef(struct Objgen *og, const char *name);
+// Append data to .rodata and return its offset, or -1 if it doesn't fit.
+ptrdiff_t objgen_rodata(struct Objgen *og, const void *data, size_t size);
+
+// Begin a function (aligned to 16 bytes) with the given name. If frame is set,
+// the function sets up a stack frame, so that it can contain calls.
+int objgen_func_begin(struct Objgen *og, const char *name, bool frame);
+// Call the symbol with the guest register file as argument.
+int objgen_func_call(struct Objgen *og, size_t sym, int64_t addend);
+// Store a value into guest register reg, i.e. the reg-th 64-bit slot of the
+// register file.
+int objgen_func_set_reg(struct Objgen *og, unsigned reg, uint64_t value);
+// Store a guest address into the first guest register (the PC) before
+// calling into the dispatcher.
+int objgen_func_set_pc(struct Objgen *og, uint64_t addr);
+// Add a small constant to guest register reg.
+int objgen_func_add_reg(struct Objgen *og, unsigned reg, int8_t imm);
+// Load the address of rodata + offset into a scratch register.
+int objgen_func_ref(struct Objgen *og, size_t sym, int64_t addend);
+// Code between these two is jumped over, e.g. for references that must be
+// linked but not executed. Returns a handle for objgen_func_cold_end.
+ptrdiff_t objgen_func_cold_begin(struct Objgen *og);
+int objgen_func_cold_end(struct Objgen *og, ptrdiff_t cold);
+int objgen_func_end(struct Objgen *og);
+// End the function with a tail call of the symbol, passing the guest register
+// file, e.g. to instrew_tail_cdecl.
+int objgen_func_end_tail(struct Objgen *og, size_t sym, int64_t addend);
+
+// Finalize the headers and return the size of the object.
+size_t objgen_finish(struct Objgen *og);
+
+#endif
@@ -10,6 +10,7 @@
 #include <linux/errno.h>
 #include <linux/fcntl.h>
 #include <linux/posix_types.h>
+#include <linux/resource.h>
 #include <linux/time.h>
 #include <linux/unistd.h>
 
@@ -43,12 +44,28 @@ int gettid(void);
 int clock_gettime(int clk_id, struct timespec *tp);
 int nanosleep(const struct timespec *req, struct timespec *rem);
 
+// sys/resource.h
+int getrusage(int who, struct rusage *usage);
+
+// sys/time.h
+int setitimer(int which, const struct itimerval *new_value,
+              struct itimerval *old_value);
+
+// linux/perf_event.h
+struct perf_event_attr;
+int perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu,
+                    int group_fd, unsigned long flags);
+
 int open(const char *pathname, int flags, int mode);
 int openat(int dirfd, const char *pathname, int flags, int mode);
 off_t lseek(int fd, off_t offset, int whence);
 ssize_t read(int fd, void *buf, size_t count);
 ssize_t write(int fd, const void *buf, size_t count);
 int close(int fd);
+int ftruncate(int fd, off_t length);
+int memfd_create(const char *name, unsigned flags);
+ssize_t readlinkat(int dirfd, const char *pathname, char *buf, size_t bufsiz);
+int unlink(const char *pathname);
 
 ssize_t read_full(int fd, void *buf, size_t nbytes);
 ssize_t write_full(int fd, const void *buf, size_t nbytes);
@@ -61,6 +78,7 @@ void *mmap(void *addr, size_t length, int prot, int flags, int fd,
            off_t offset);
 int munmap(void *addr, size_t length);
 int mprotect(void *addr, size_t len, int prot);
+int madvise(void *addr, size_t len, int advice);
 
 // stdio.h
 int vsnprintf(char *str, size_t size, const char *restrict format, va_list args);
@@ -108,6 +126,9 @@ int __clone(int (*func)(void *), void *stack, int flags, void *arg, ...);
 size_t getpagesize(void) __attribute__((const));
 
 int atoi(const char* str);
+unsigned long strtoul(const char *str, char **endptr, int base);
+void qsort(void *base, size_t nmemb, size_t size,
+           int (*compar)(const void *, const void *));
 
 #define STRINGIFY_ARG(x) #x
 #define STRINGIFY(x) STRINGIFY_ARG(x)
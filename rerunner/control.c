@@ -0,0 +1,174 @@
+#include <asm/sigcontext.h>
+#include <asm/siginfo.h>
+#include <asm/signal.h>
+#include <asm/ucontext.h>
+#include <linux/mman.h>
+
+#include "common.h"
+#include "control.h"
+#include "cpu-state.h"
+#include "dispatch.h"
+#include "memory.h"
+#include "rtld.h"
+#include "sampler.h"
+#include "stats.h"
+#include "symbols.h"
+#include "trace.h"
+
+#define CONTROL_SAMPLER_FREQ 1000
+
+_Atomic unsigned control_pending;
+static bool control_active;
+static unsigned control_snapshot_index;
+
+static void
+control_handler(int sig, struct siginfo *info, void *ucp)
+{
+    (void)sig;
+    unsigned cmd = info->si_code == SI_QUEUE ? (unsigned)info->si_int : CONTROL_STATS;
+    if (!cmd || cmd >= CONTROL_COMMAND_COUNT)
+        return;
+    atomic_fetch_or_explicit(&control_pending, 1u << cmd, memory_order_relaxed);
+
+    // Translated code doesn't hold any runner state, so it is safe to run the
+    // command right here. Otherwise, wait for the next safe point.
+    struct ucontext *uc = ucp;
+#if defined(__x86_64__)
+    uintptr_t pc = uc->uc_mcontext.rip;
+#elif defined(__aarch64__)
+    uintptr_t pc = uc->uc_mcontext.pc;
+#else
+#error "missing PC in signal context"
+#endif
+    if (mem_code_contains(pc))
+        control_run_pending(get_thread_area());
+}
+
+int control_init(struct CpuState *cpu_state)
+{
+    (void)cpu_state;
+    struct sigaction act;
+    act.sa_handler = (void (*)())control_handler;
+    act.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigfillset(&act.sa_mask);
+    sigdelset(&act.sa_mask, SIGSEGV);
+    sigdelset(&act.sa_mask, SIGBUS);
+    int ret = sigaction(CONTROL_SIGNAL, &act, NULL);
+    if (ret < 0)
+        return ret;
+    control_active = true;
+    return 0;
+}
+
+bool control_enabled(void)
+{
+    return control_active;
+}
+
+// Write the used part of the code arena and a map with one line per function:
+// offset into the arena, size, guest address and guest symbol.
+static int
+control_snapshot(struct State *state)
+{
+    char path[sizeof(dir_path) + 32];
+    unsigned index = control_snapshot_index++;
+    struct MemUsage usage;
+    mem_get_usage(&usage);
+    uintptr_t base = (uintptr_t)mem_code_start();
+
+    snprintf(path, sizeof(path), "%scodecache.%u.bin", dir_path, index);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return fd;
+    ssize_t ret = write_full(fd, (const void *)base, usage.code_used);
+    close(fd);
+    if (ret < 0)
+        return ret;
+
+    Rtld *r = &state->rtld;
+    size_t ranges_cap = r->ranges_cap;
+    size_t ranges_size = ranges_cap * sizeof(struct RtldRange);
+    struct RtldRange *ranges = mmap(NULL, ranges_size, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (BAD_ADDR(ranges))
+        return (int)(uintptr_t)ranges;
+    ret = rtld_ranges_copy(r, ranges, ranges_cap);
+    if (ret < 0)
+        goto out;
+    size_t count = ret;
+
+    snprintf(path, sizeof(path), "%scodecache.%u.map", dir_path, index);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        ret = fd;
+        goto out;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        char name[256] = "";
+        symbols_format(ranges[i].addr, name, sizeof(name));
+        dprintf(fd, "%lx %lx %lx %s\n", ranges[i].start - base,
+                ranges[i].end - ranges[i].start, ranges[i].addr, name);
+    }
+    close(fd);
+    dprintf(2, "code cache snapshot written to %scodecache.%u.*\n", dir_path, index);
+    ret = 0;
+
+out:
+    munmap(ranges, ranges_size);
+    return ret;
+}
+
+static int
+control_run(struct CpuState *cpu_state, enum ControlCommand cmd)
+{
+    struct State *state = cpu_state->state;
+    static char samples_path[sizeof(dir_path) + sizeof(SAMPLER_FILE_NAME)];
+
+    switch (cmd)
+    {
+    case CONTROL_STATS:
+        stats_print_fd(cpu_state, state->stats_fd >= 0 ? state->stats_fd : 2);
+        return 0;
+    case CONTROL_SAMPLER_START:
+        if (sampler_enabled())
+            return sampler_resume();
+        snprintf(samples_path, sizeof(samples_path), "%s%s", dir_path,
+                 SAMPLER_FILE_NAME);
+        return sampler_init(CONTROL_SAMPLER_FREQ, samples_path);
+    case CONTROL_SAMPLER_STOP:
+        return sampler_enabled() ? sampler_finish(state) : 0;
+    case CONTROL_COUNT_START:
+    case CONTROL_COUNT_STOP:
+        if (!state->profile.entries)
+            return -EINVAL;
+        // Commit or drop the counts of the current period.
+        dispatch_profile_collect(cpu_state);
+        state->profile_paused = cmd == CONTROL_COUNT_STOP;
+        return 0;
+    case CONTROL_PROFILE_FLUSH:
+        if (!state->profile.entries)
+            return -EINVAL;
+        return dispatch_profile_write(cpu_state);
+    case CONTROL_SNAPSHOT:
+        return control_snapshot(state);
+    case CONTROL_TRACE:
+        return trace_write();
+    default:
+        return -EINVAL;
+    }
+}
+
+void control_run_pending(struct CpuState *cpu_state)
+{
+    unsigned pending = atomic_exchange_explicit(&control_pending, 0, memory_order_acquire);
+    for (unsigned cmd = 1; cmd < CONTROL_COMMAND_COUNT; cmd++)
+    {
+        if (!(pending & (1u << cmd)))
+            continue;
+        int ret = control_run(cpu_state, cmd);
+        if (ret < 0)
+            dprintf(2, "warning: control command %u failed: %u\n", cmd, -ret);
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef _INSTREW_RUNNER_CONTROL_H
+#define _INSTREW_RUNNER_CONTROL_H
+
+#include <stdatomic.h>
+
+#include "common.h"
+
+struct CpuState;
+
+// Control channel: with -control, CONTROL_SIGNAL is reserved for the runner.
+// The command is passed as the integer value of sigqueue(3); a plain kill
+// dumps the statistics. Commands are executed right away if translated code
+// was interrupted, otherwise at the next syscall or quick TLB miss, where the
+// runner's state is consistent.
+#define CONTROL_SIGNAL SIGRTMAX
+
+enum ControlCommand
+{
+    CONTROL_STATS = 1,      // print statistics to the stats file or stderr
+    CONTROL_SAMPLER_START,  // start or resume the sampler
+    CONTROL_SAMPLER_STOP,   // stop the sampler and write the samples
+    CONTROL_COUNT_START,    // resume counting dispatches for the profile
+    CONTROL_COUNT_STOP,     // pause counting dispatches
+    CONTROL_PROFILE_FLUSH,  // write the profile
+    CONTROL_SNAPSHOT,       // write the code arena and a map of its functions
+    CONTROL_TRACE,          // write the event trace
+    CONTROL_COMMAND_COUNT,
+};
+
+int control_init(struct CpuState *cpu_state);
+bool control_enabled(void);
+
+// Bit set of commands waiting for a safe point.
+extern _Atomic unsigned control_pending;
+void control_run_pending(struct CpuState *cpu_state);
+
+static inline void
+control_poll(struct CpuState *cpu_state)
+{
+    if (UNLIKELY(atomic_load_explicit(&control_pending, memory_order_relaxed) != 0))
+        control_run_pending(cpu_state);
+}
+
+#endif
@@ -2,7 +2,10 @@
 #define _INSTREW_RUNNER_CPU_STATE_H
 
 #include "common.h"
+#include "profile.h"
 #include "rtld.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <asm/siginfo.h>
 #include <asm/signal.h>
@@ -13,7 +16,21 @@ struct State
 {
     Rtld rtld;
     struct sigaction sigact[_NSIG];
-    uint64_t rew_time;
+
+    struct Stats stats;
+
+    // File descriptor for statistics at exit, -1 if disabled.
+    int stats_fd;
+
+    // Dispatch counts per guest function, if profiling is enabled.
+    struct ProfileTable profile;
+    const char *profile_path;
+    // Counting was stopped through the control channel; dispatches are still
+    // counted by the dispatcher, but discarded.
+    bool profile_paused;
+    // Call graph edge tables of all threads, if recording is enabled.
+    struct ProfileEdgeTable *_Atomic edge_tables;
+    const char *callgraph_path;
 };
 
 struct CpuState
@@ -21,11 +38,23 @@ struct CpuState
     struct CpuState *self;
     struct State *state;
 
-    uintptr_t _unused[6];
+    // Call graph edges recorded by this thread, or NULL.
+    struct ProfileEdgeTable *edges;
+    // Event trace of this thread, or NULL.
+    struct TraceBuffer *trace;
+    // Kernel thread id, cached to avoid the syscall.
+    int tid;
+
+    uintptr_t _unused[3];
 
     _Alignas(64) uint8_t regdata[0x400];
 
     _Alignas(64) uint64_t quick_tlb[1 << QUICK_TLB_BITS][2];
+    // Dispatches through each quick_tlb entry since it was filled; only used
+    // by the counting dispatcher.
+    uint64_t quick_tlb_count[1 << QUICK_TLB_BITS];
+
+    struct StatsThread stats;
 
     _Atomic volatile int sigpending;
     sigset_t sigmask;
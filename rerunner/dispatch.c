@@ -1,12 +1,19 @@
 #include <elf.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
 
 #include "common.h"
+#include "control.h"
 #include "cpu-state.h"
 #include "dispatch.h"
 #include "dispatcher-info.h"
+#include "livestats.h"
 #include "memory.h"
+#include "perfctr.h"
+#include "profile.h"
 #include "rtld.h"
+#include "stats.h"
+#include "symbols.h"
 
 // Prototype to make compilers happy. This is used in the assembly HHVM
 // dispatcher on x86-64 below.
@@ -31,6 +38,98 @@ uintptr_t resolve_func(struct CpuState *, uintptr_t, struct RtldPatchData *);
 
 #define PATH_MAX 4096
 
+int dispatch_load(struct State *state, struct StatsHist *stages,
+                  struct TraceBuffer *trace, uintptr_t addr)
+{
+    // The stages are only timed if the statistics are printed or traced;
+    // every timestamp is a clock_gettime syscall.
+    bool timed = state->stats_fd >= 0 || UNLIKELY(trace != NULL);
+    uint64_t time_start = timed ? stats_now() : 0;
+
+    char file_path[PATH_MAX];
+    snprintf(file_path, sizeof(file_path), "%s%lx", dir_path, (unsigned long)addr);
+
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+        return fd;
+    uint64_t time_open = timed ? stats_now() : 0;
+    struct stat st;
+    stat(file_path, &st);
+    uint64_t time_stat = timed ? stats_now() : 0;
+
+    size_t obj_size = ALIGN_UP(st.st_size, getpagesize());
+    void *obj_base = mem_alloc_data(obj_size, getpagesize());
+    if (BAD_ADDR(obj_base))
+    {
+        close(fd);
+        return (int)(uintptr_t)obj_base;
+    }
+    ssize_t ret = read_full(fd, obj_base, st.st_size);
+    close(fd);
+    if (ret < 0)
+        return ret;
+    uint64_t time_read = timed ? stats_now() : 0;
+
+    struct RtldAddTimes times;
+    int retval = rtld_add_object(&state->rtld, obj_base, obj_size, addr,
+                                 timed ? &times : NULL);
+    if (retval < 0)
+        return retval;
+
+    state->stats.loads++;
+    state->stats.load_bytes += st.st_size;
+    stats_load_milestone(&state->stats);
+    if (!timed)
+        return 0;
+    uint64_t time_end = stats_now();
+    stats_hist_add(&stages[STATS_STAGE_OPEN], time_open - time_start);
+    stats_hist_add(&stages[STATS_STAGE_STAT], time_stat - time_open);
+    stats_hist_add(&stages[STATS_STAGE_READ], time_read - time_stat);
+    stats_hist_add(&stages[STATS_STAGE_RELOC], times.reloc);
+    stats_hist_add(&stages[STATS_STAGE_COPY], times.copy);
+    stats_hist_add(&stages[STATS_STAGE_PUBLISH], times.publish);
+    if (UNLIKELY(trace != NULL))
+        trace_add(trace, TRACE_LOAD, time_start, time_end, addr);
+    return 0;
+}
+
+int dispatch_preload(struct State *state, struct TraceBuffer *trace,
+                     const char *profile_path)
+{
+    uint64_t time_start = stats_now();
+    struct ProfileEntry *entries;
+    size_t count;
+    int retval = profile_read(profile_path, &entries, &count);
+    if (retval < 0)
+        return retval;
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; i++)
+        total += entries[i].count;
+
+    // Load the functions that make up most of the dispatches in order of
+    // decreasing frequency, so that hot code is densely packed at the start
+    // of the code arena. Everything else is loaded on demand behind it.
+    uint64_t covered = 0;
+    for (size_t i = 0; i < count && covered < total - total / 100; i++)
+    {
+        covered += entries[i].count;
+        void *func;
+        if (rtld_resolve(&state->rtld, entries[i].addr, &func) == 0)
+            continue;
+        retval = dispatch_load(state, state->stats.stages, trace, entries[i].addr);
+        if (retval == -ENOENT) // stale profile, ignore
+            continue;
+        if (retval < 0)
+            return retval;
+    }
+
+    mem_code_new_region();
+    if (UNLIKELY(trace != NULL))
+        trace_add(trace, TRACE_PRELOAD, time_start, stats_now(), state->stats.loads);
+    return 0;
+}
+
 GNU_FORCE_EXTERN
 uintptr_t
 resolve_func(struct CpuState *cpu_state, uintptr_t addr,
@@ -41,54 +140,83 @@ resolve_func(struct CpuState *cpu_state, uintptr_t addr,
     if (patch_data)
         addr = patch_data->sym_addr;
 
+    cpu_state->stats.tlb_misses++;
+    control_poll(cpu_state);
+    livestats_poll(cpu_state);
+    enum PerfctrPhase prev_phase = perfctr_phase(cpu_state, PERFCTR_RESOLVE);
+
+    struct TraceBuffer *trace = cpu_state->trace;
+    // Timing costs two clock reads on every miss, so only do it if the
+    // statistics are printed or traced.
+    bool timed = state->stats_fd >= 0 || UNLIKELY(trace != NULL);
+    uint64_t time_start = timed ? stats_now() : 0;
     void *func;
     int retval = rtld_resolve(&state->rtld, addr, &func);
-    if (UNLIKELY(retval < 0))
+    if (timed)
+        stats_hist_add(&cpu_state->stats.stages[STATS_STAGE_LOOKUP],
+                       stats_now() - time_start);
+    if (LIKELY(retval == 0))
     {
-        struct timespec start_time;
-        struct timespec end_time;
-        clock_gettime(CLOCK_MONOTONIC, &start_time);
-
-        void *obj_base;
-        size_t obj_size;
-        
-        char file_path[PATH_MAX] = "", file_name[PATH_MAX] = "";
-        strncpy(file_path, dir_path, sizeof(file_path));
-        snprintf(file_name, sizeof(file_name), "%lx", (unsigned long) addr);
-        strncpy(file_path + strlen(file_path), file_name, sizeof(file_path));
-        
-        int fd = open(file_path, O_RDWR, 0);
-        struct stat st;
-        stat(file_path, &st);
-        
-        obj_size = ALIGN_UP(st.st_size, getpagesize());
-        obj_base = mem_alloc_data(obj_size, getpagesize());
-        read_full(fd, obj_base, obj_size);
-        retval = rtld_add_object(&state->rtld, obj_base, obj_size, addr);
-
+        state->stats.resolves++;
+    }
+    else
+    {
+        retval = dispatch_load(state, cpu_state->stats.stages, trace, addr);
         if (retval < 0)
             goto error;
         retval = rtld_resolve(&state->rtld, addr, &func);
         if (retval < 0)
             goto error;
-
-        clock_gettime(CLOCK_MONOTONIC, &end_time);
-        size_t time_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000 + (end_time.tv_nsec - start_time.tv_nsec);
-        state->rew_time += time_ns;
     }
 
-    // If possible, patch code which caused us to get here.
-    rtld_patch(patch_data, func);
+    // If possible, patch code which caused us to get here. When profiling,
+    // all calls must go through the dispatcher to be counted.
+    if (patch_data && !state->profile.entries && !cpu_state->edges)
+    {
+        uint64_t time_patch = timed ? stats_now() : 0;
+        rtld_patch(patch_data, func);
+        mem_flush_code();
+        state->stats.patches++;
+        if (timed)
+        {
+            uint64_t time_end = stats_now();
+            stats_hist_add(&cpu_state->stats.stages[STATS_STAGE_PATCH],
+                           time_end - time_patch);
+            if (UNLIKELY(trace != NULL))
+                trace_add(trace, TRACE_PATCH, time_patch, time_end, addr);
+        }
+    }
 
     // Update quick TLB
     uintptr_t hash = QUICK_TLB_HASH(addr);
+    if (state->profile.entries)
+    {
+        if (!state->profile_paused)
+            profile_table_add(&state->profile, cpu_state->quick_tlb[hash][0],
+                              cpu_state->quick_tlb_count[hash]);
+        cpu_state->quick_tlb_count[hash] = 0;
+    }
+    if (UNLIKELY(trace != NULL))
+    {
+        uint64_t time_end = stats_now();
+        uintptr_t old = cpu_state->quick_tlb[hash][0];
+        if (old && old != addr)
+            trace_add(trace, TRACE_EVICT, time_end, time_end, old);
+        trace_add(trace, TRACE_MISS, time_start, time_end, addr);
+    }
     cpu_state->quick_tlb[hash][0] = addr;
     cpu_state->quick_tlb[hash][1] = (uintptr_t)func;
 
+    perfctr_phase(cpu_state, prev_phase);
     return (uintptr_t)func;
 
-error:
-    dprintf(2, "error resolving address %lx: %u\n", addr, -retval);
+error:;
+    char name[256] = "";
+    symbols_format(addr, name, sizeof(name));
+    dprintf(2, "error resolving address %lx%s%s: %u\n", addr, name[0] ? " " : "",
+            name, -retval);
+    trace_write();
+    stats_print_fatal();
     _exit(retval);
 }
 
@@ -104,6 +232,7 @@ inline void dispatch_cdecl(uint64_t *cpu_regs)
     uintptr_t func = cpu_state->quick_tlb[hash][1];
     if (UNLIKELY(cpu_state->quick_tlb[hash][0] != addr))
         func = resolve_func(cpu_state, addr, NULL);
+    cpu_state->stats.dispatches++;
 
     void (*func_p)(void *);
     *((void **)&func_p) = (void *)func;
@@ -119,6 +248,132 @@ dispatch_cdecl_loop(uint64_t *cpu_regs)
     }
 }
 
+// Counting variant of the cdecl dispatcher. Counts are kept per quick_tlb
+// entry and moved to the profile table when the entry is replaced.
+void dispatch_cdecl_count(uint64_t *);
+
+inline void dispatch_cdecl_count(uint64_t *cpu_regs)
+{
+    struct CpuState *cpu_state = CPU_STATE_FROM_REGS(cpu_regs);
+    uintptr_t addr = cpu_regs[0];
+    uintptr_t hash = QUICK_TLB_HASH(addr);
+
+    uintptr_t func = cpu_state->quick_tlb[hash][1];
+    if (UNLIKELY(cpu_state->quick_tlb[hash][0] != addr))
+        func = resolve_func(cpu_state, addr, NULL);
+    cpu_state->quick_tlb_count[hash]++;
+    cpu_state->stats.dispatches++;
+
+    void (*func_p)(void *);
+    *((void **)&func_p) = (void *)func;
+    func_p(cpu_regs);
+}
+
+static void
+dispatch_cdecl_count_loop(uint64_t *cpu_regs)
+{
+    while (true)
+    {
+        dispatch_cdecl_count(cpu_regs);
+    }
+}
+
+// Additionally records the call site in translated code for every dispatch.
+// The PLT and stubs reach it through jumps, so the return address is the call
+// site; for the dispatch loop, it points to the runtime instead.
+// Tail calls are attributed to the caller that will be returned to.
+void dispatch_cdecl_edges(uint64_t *);
+
+__attribute__((noinline)) void dispatch_cdecl_edges(uint64_t *cpu_regs)
+{
+    struct CpuState *cpu_state = CPU_STATE_FROM_REGS(cpu_regs);
+    profile_edges_add(cpu_state->edges, (uintptr_t)__builtin_return_address(0),
+                      cpu_regs[0], 1);
+    dispatch_cdecl_count(cpu_regs);
+}
+
+static void
+dispatch_cdecl_edges_loop(uint64_t *cpu_regs)
+{
+    while (true)
+    {
+        dispatch_cdecl_edges(cpu_regs);
+    }
+}
+
+int dispatch_callgraph_init(struct CpuState *cpu_state)
+{
+    struct State *state = cpu_state->state;
+    struct ProfileEdgeTable *table = profile_edges_create(14);
+    if (BAD_ADDR(table))
+        return (int)(uintptr_t)table;
+
+    table->next = atomic_load_explicit(&state->edge_tables, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&state->edge_tables, &table->next, table,
+                                                  memory_order_release, memory_order_relaxed))
+        ;
+    cpu_state->edges = table;
+    return 0;
+}
+
+int dispatch_callgraph_write(struct State *state)
+{
+    // Merge the tables of all threads, mapping call sites to guest callers.
+    // Calls from the dispatch loop have no caller and are recorded with 0.
+    // Call sites in the code arena outside of any function are dropped.
+    struct ProfileEdgeTable *merged = profile_edges_create(16);
+    if (BAD_ADDR(merged))
+        return (int)(uintptr_t)merged;
+    uint64_t unresolved = 0;
+    struct ProfileEdgeTable *table = atomic_load_explicit(&state->edge_tables, memory_order_acquire);
+    for (; table; table = table->next)
+    {
+        for (size_t i = 0; i <= table->mask; i++)
+        {
+            struct ProfileEdge *edge = &table->edges[i];
+            if (!edge->count)
+                continue;
+            uintptr_t caller = 0;
+            if (mem_code_contains(edge->from) &&
+                rtld_lookup_host(&state->rtld, edge->from, &caller, NULL) < 0)
+            {
+                unresolved += edge->count;
+                continue;
+            }
+            profile_edges_add(merged, caller, edge->to, edge->count);
+        }
+        merged->dropped += table->dropped;
+    }
+    if (merged->dropped)
+        dprintf(2, "warning: call graph table full, dropped %lu calls\n",
+                merged->dropped);
+    if (unresolved)
+        dprintf(2, "warning: dropped %lu calls from unknown call sites\n", unresolved);
+    return profile_edges_write(merged, state->callgraph_path);
+}
+
+void dispatch_profile_collect(struct CpuState *cpu_state)
+{
+    struct State *state = cpu_state->state;
+    for (size_t i = 0; i < (1 << QUICK_TLB_BITS); i++)
+    {
+        if (!state->profile_paused)
+            profile_table_add(&state->profile, cpu_state->quick_tlb[i][0],
+                              cpu_state->quick_tlb_count[i]);
+        cpu_state->quick_tlb_count[i] = 0;
+    }
+}
+
+int dispatch_profile_write(struct CpuState *cpu_state)
+{
+    struct State *state = cpu_state->state;
+    dispatch_profile_collect(cpu_state);
+    if (state->profile.dropped)
+        dprintf(2, "warning: profile table full, dropped %lu dispatches\n",
+                state->profile.dropped);
+    return profile_table_write(&state->profile, state->profile_path);
+}
+
 #ifdef __x86_64__
 
 __attribute__((noreturn)) extern void dispatch_hhvm(uint64_t *cpu_state);
@@ -364,7 +619,7 @@ dispatch_aapcsx_fullresolve:
 
 #endif // defined(__aarch64__)
 
-struct DispatcherInfo dispatch_get()
+struct DispatcherInfo dispatch_get(bool count, bool edges)
 {
     static const struct DispatcherInfo info = {
         .loop_func = dispatch_cdecl_loop,
@@ -372,5 +627,21 @@ struct DispatcherInfo dispatch_get()
         .full_dispatch_func = (uintptr_t)dispatch_cdecl,
         .patch_data_reg = 6, // rsi
     };
-    return info;
+    static const struct DispatcherInfo info_count = {
+        .loop_func = dispatch_cdecl_count_loop,
+        .quick_dispatch_func = (uintptr_t)dispatch_cdecl_count,
+        .full_dispatch_func = (uintptr_t)dispatch_cdecl_count,
+        .patch_data_reg = 6, // rsi
+        .counting = true,
+    };
+    static const struct DispatcherInfo info_edges = {
+        .loop_func = dispatch_cdecl_edges_loop,
+        .quick_dispatch_func = (uintptr_t)dispatch_cdecl_edges,
+        .full_dispatch_func = (uintptr_t)dispatch_cdecl_edges,
+        .patch_data_reg = 6, // rsi
+        .counting = true,
+    };
+    if (edges)
+        return info_edges;
+    return count ? info_count : info;
 }
@@ -5,6 +5,27 @@
 #include "dispatcher-info.h"
 #include "cpu-state.h"
 
-struct DispatcherInfo dispatch_get(void);
+// With count, the dispatcher counts dispatches per guest function into
+// State::profile. With edges, it also records the call site of every dispatch
+// into CpuState::edges.
+struct DispatcherInfo dispatch_get(bool count, bool edges);
+
+// Load the object for the guest function at addr from the cache directory,
+// recording the latency of each stage into stages and the load into trace,
+// which may be NULL.
+int dispatch_load(struct State *state, struct StatsHist *stages,
+                  struct TraceBuffer *trace, uintptr_t addr);
+// Load the hot functions of a profile ahead of execution.
+int dispatch_preload(struct State *state, struct TraceBuffer *trace,
+                     const char *profile_path);
+// Move the pending counts of the calling thread into State::profile; they are
+// dropped if counting is paused.
+void dispatch_profile_collect(struct CpuState *cpu_state);
+// Collect the counts of the calling thread and write the profile.
+int dispatch_profile_write(struct CpuState *cpu_state);
+// Set up call graph recording for a new thread.
+int dispatch_callgraph_init(struct CpuState *cpu_state);
+// Merge the call graph of all threads and write it.
+int dispatch_callgraph_write(struct State *state);
 
 #endif
@@ -10,6 +10,9 @@ struct DispatcherInfo
     uintptr_t full_dispatch_func;
 
     uint8_t patch_data_reg;
+    // Every guest call must reach the dispatcher to be counted, so calls are
+    // never linked directly to loaded code.
+    bool counting;
 };
 
 #endif
\ No newline at end of file
@@ -9,6 +9,7 @@
 
 #include "common.h"
 #include <elf-loader.h>
+#include <symbols.h>
 
 
 static int
@@ -123,6 +124,8 @@ elf_map(uintptr_t addr, const Elf_Phdr* elf_ppnt, int fd) {
             retval = (int) (uintptr_t) mapret;
             goto out;
         }
+        if (elf_ppnt->p_flags & PF_X)
+            symbols_add_image(fd, mapstart, mapend, mapoff);
     }
 
     if (allocend > dataend)
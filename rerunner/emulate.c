@@ -11,7 +11,15 @@
 #include <linux/sched.h>
 #include <linux/utsname.h>
 
+#include <control.h>
 #include <cpu-state.h>
+#include <dispatch.h>
+#include <livestats.h>
+#include <replay.h>
+#include <sampler.h>
+#include <stats.h>
+#include <symbols.h>
+#include <trace.h>
 
 // SIG_DFL should be zero, so zero-initializing sigact is sufficient
 // Unfortunately, this is not an integer constant expression.
@@ -22,6 +30,8 @@ _Static_assert(SIGUSR1 == 10, "SIGUSR10 mismtach");
 static _Noreturn void
 abort_with_signal(int sig)
 {
+    stats_print_fatal();
+
     struct sigaction act;
     act.sa_handler = SIG_DFL;
     act.sa_flags = 0;
@@ -33,12 +43,33 @@ abort_with_signal(int sig)
     __builtin_unreachable();
 }
 
+// Signals used by the runner itself, which are never delivered to the guest.
+static bool
+signal_is_reserved(int sig)
+{
+    if (sig == SAMPLER_SIGNAL && sampler_enabled())
+        return true;
+    if (sig == CONTROL_SIGNAL && control_enabled())
+        return true;
+    return false;
+}
+
+static void
+signal_unblock_reserved(sigset_t *set)
+{
+    sigdelset(set, SIGSEGV);
+    sigdelset(set, SIGBUS);
+    if (sampler_enabled())
+        sigdelset(set, SAMPLER_SIGNAL);
+    if (control_enabled())
+        sigdelset(set, CONTROL_SIGNAL);
+}
+
 static int
 signal_update_hostmask(struct CpuState *cpu_state)
 {
     sigset_t hostmask = cpu_state->sigmask;
-    sigdelset(&hostmask, SIGSEGV);
-    sigdelset(&hostmask, SIGBUS);
+    signal_unblock_reserved(&hostmask);
     return sigprocmask(SIG_SETMASK, &hostmask, NULL);
 }
 
@@ -47,6 +78,11 @@ signal_handle(struct CpuState *cpu_state)
 {
     int sig = cpu_state->sigpending;
     cpu_state->sigpending = 0;
+    if (UNLIKELY(cpu_state->trace != NULL))
+    {
+        uint64_t now = stats_now();
+        trace_add(cpu_state->trace, TRACE_SIGNAL, now, now, sig);
+    }
 
     // Copy act to reduce likelihood of race. TODO: make this thread-safe.
     struct sigaction act = cpu_state->state->sigact[sig - 1];
@@ -113,8 +149,7 @@ signal_handler(int sig, struct siginfo *info, void *ucp)
     // Keep all signals masked until guest signal handler executed.
     struct ucontext *uc = ucp;
     sigfillset(&uc->uc_sigmask);
-    sigdelset(&uc->uc_sigmask, SIGSEGV);
-    sigdelset(&uc->uc_sigmask, SIGBUS);
+    signal_unblock_reserved(&uc->uc_sigmask);
 }
 
 static int
@@ -133,6 +168,8 @@ signal_sigaction(struct CpuState *cpu_state, int sig,
     state->sigact[sig - 1] = *nact;
     if (sig == SIGSEGV || sig == SIGBUS)
         return 0;
+    if (signal_is_reserved(sig))
+        return 0;
 
     struct sigaction act;
     if (nact->sa_handler == SIG_DFL || nact->sa_handler == SIG_IGN)
@@ -312,17 +349,75 @@ emulate_cpuid(uint32_t rax, uint32_t rcx)
     return res;
 }
 
+// Whether a host syscall that failed with EINTR has to be issued again. The
+// reserved signals have host handlers, so they interrupt blocking syscalls that
+// the kernel never restarts (ppoll, pselect6, clock_nanosleep, rt_sigsuspend,
+// ...), even though the guest didn't get a signal. ppoll and the select family
+// update the timeout in place; a relative clock_nanosleep continues with the
+// remaining time, which is always requested for that purpose.
+static __attribute__((noinline)) bool
+emulate_host_syscall_restart(uint64_t nr, uint64_t arg1, uint64_t *arg2,
+                             uint64_t arg3)
+{
+    struct CpuState *cpu_state = get_thread_area();
+    if (cpu_state->sigpending)
+        return false;
+    if (nr == __NR_clock_nanosleep && !(arg1 & TIMER_ABSTIME))
+        *arg2 = arg3;
+    return true;
+}
+
+// Host syscall on behalf of the guest, recorded or replayed with
+// -record/-replay.
+static inline long
+emulate_host_syscall(uint64_t nr, uint64_t arg0, uint64_t arg1, uint64_t arg2,
+                     uint64_t arg3, uint64_t arg4, uint64_t arg5)
+{
+    struct timespec rem;
+    if (nr == __NR_clock_nanosleep && !(arg1 & TIMER_ABSTIME) && !arg3)
+        arg3 = (uintptr_t)&rem;
+
+    long res;
+    do
+    {
+        if (LIKELY(replay_mode == REPLAY_OFF))
+            res = syscall(nr, arg0, arg1, arg2, arg3, arg4, arg5);
+        else
+            res = replay_syscall(nr, arg0, arg1, arg2, arg3, arg4, arg5);
+    } while (UNLIKELY(res == -EINTR) &&
+             emulate_host_syscall_restart(nr, arg1, &arg2, arg3));
+    return res;
+}
+
+// Called when the guest terminates through exit_group.
+static void
+emulate_exit_group(struct CpuState *cpu_state)
+{
+    struct State *state = cpu_state->state;
+    stats_print(cpu_state);
+    livestats_finish(cpu_state);
+    if (trace_write() < 0)
+        dprintf(2, "warning: could not write trace\n");
+    if (sampler_enabled() && sampler_finish(state) < 0)
+        dprintf(2, "warning: could not write samples\n");
+    if (state->profile.entries && dispatch_profile_write(cpu_state) < 0)
+        dprintf(2, "warning: could not write profile %s\n", state->profile_path);
+    if (state->callgraph_path && dispatch_callgraph_write(state) < 0)
+        dprintf(2, "warning: could not write call graph %s\n", state->callgraph_path);
+}
+
 static ssize_t
-unhandled_syscall(uint64_t nr, uint64_t arg0, uint64_t arg1, uint64_t arg2,
-                  uint64_t arg3, uint64_t arg4, uint64_t arg5)
+unhandled_syscall(struct CpuState *cpu_state, uint64_t nr, uint64_t arg0,
+                  uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4,
+                  uint64_t arg5)
 {
-    // warn only once about each syscall; 1024 should be high enough.
-    static uint64_t warnmap[16];
-    if (nr < sizeof(warnmap) * 8)
+    // warn only once about each syscall; the set is reported with -stats.
+    uint64_t *unhandled = cpu_state->state->stats.syscall_unhandled;
+    if (nr < STATS_SYSCALLS)
     {
-        if (warnmap[nr / 64] & (1 << nr % 64))
+        if (unhandled[nr / 64] & (1ull << nr % 64))
             goto skipwarning;
-        warnmap[nr / 64] |= 1 << nr % 64;
+        unhandled[nr / 64] |= 1ull << nr % 64;
     }
     dprintf(2, "unhandled syscall %u (%lx %lx %lx %lx %lx %lx) = -ENOSYS"
                " -- please file a bug with these numbers and the architecture\n",
@@ -332,6 +427,31 @@ skipwarning:
     return -ENOSYS;
 }
 
+// Count a guest syscall and start timing it if profiled or traced; returns
+// the start time or 0.
+static uint64_t
+emulate_syscall_begin(struct CpuState *cpu_state, uint64_t nr)
+{
+    cpu_state->stats.syscalls++;
+    stats_syscall(cpu_state->stats.syscall_nrs, nr)->count++;
+    control_poll(cpu_state);
+    livestats_poll(cpu_state);
+    if (cpu_state->state->stats_fd < 0 && LIKELY(cpu_state->trace == NULL))
+        return 0;
+    return stats_now();
+}
+
+static void
+emulate_syscall_end(struct CpuState *cpu_state, uint64_t nr, uint64_t start)
+{
+    if (!start)
+        return;
+    uint64_t end = stats_now();
+    stats_syscall_time(stats_syscall(cpu_state->stats.syscall_nrs, nr), start, end);
+    if (UNLIKELY(cpu_state->trace != NULL))
+        trace_add(cpu_state->trace, TRACE_SYSCALL, start, end, nr);
+}
+
 void emulate_syscall(uint64_t *cpu_regs)
 {
     struct CpuState *cpu_state = CPU_STATE_FROM_REGS(cpu_regs);
@@ -339,20 +459,22 @@ void emulate_syscall(uint64_t *cpu_regs)
 
     uint64_t arg0 = cpu_regs[8], arg1 = cpu_regs[7], arg2 = cpu_regs[3],
              arg3 = cpu_regs[11], arg4 = cpu_regs[9], arg5 = cpu_regs[10];
-    uint64_t nr = cpu_regs[1];
+    // nr is replaced by the host syscall number below.
+    uint64_t nr = cpu_regs[1], guest_nr = nr;
     ssize_t res = -ENOSYS;
+    uint64_t time_start = emulate_syscall_begin(cpu_state, guest_nr);
 
     switch (nr)
     {
         struct stat tmp_struct;
 
     native:
-        res = syscall(nr, arg0, arg1, arg2, arg3, arg4, arg5);
+        res = emulate_host_syscall(nr, arg0, arg1, arg2, arg3, arg4, arg5);
         break;
 
     default:
     unhandled:
-        res = unhandled_syscall(nr, arg0, arg1, arg2, arg3, arg4, arg5);
+        res = unhandled_syscall(cpu_state, guest_nr, arg0, arg1, arg2, arg3, arg4, arg5);
         break;
 
     // Some syscalls are easy.
@@ -368,9 +490,11 @@ void emulate_syscall(uint64_t *cpu_regs)
     case 8:
         nr = __NR_lseek;
         goto native;
-    case 9:
-        nr = __NR_mmap;
-        goto native; // TODO: catch dangerous maps
+    case 9: // TODO: catch dangerous maps
+        res = emulate_host_syscall(__NR_mmap, arg0, arg1, arg2, arg3, arg4, arg5);
+        if (replay_mode != REPLAY_REPLAY) // the file descriptor is not real
+            symbols_guest_mmap(res, arg1, arg2, arg3, arg4, arg5);
+        break;
     case 10:
         nr = __NR_mprotect;
         goto native; // TODO: catch dangerous maps
@@ -553,34 +677,34 @@ void emulate_syscall(uint64_t *cpu_regs)
         nr = __NR_openat;
         goto native;
     case 21: // access
-        res = syscall(__NR_faccessat, AT_FDCWD, arg0, arg1, 0, 0, 0);
+        res = emulate_host_syscall(__NR_faccessat, AT_FDCWD, arg0, arg1, 0, 0, 0);
         break;
     case 22: // pipe
-        res = syscall(__NR_pipe2, arg0, 0, 0, 0, 0, 0);
+        res = emulate_host_syscall(__NR_pipe2, arg0, 0, 0, 0, 0, 0);
         break;
     case 82: // rename
-        res = syscall(__NR_renameat, AT_FDCWD, arg0, AT_FDCWD, arg1, 0, 0);
+        res = emulate_host_syscall(__NR_renameat, AT_FDCWD, arg0, AT_FDCWD, arg1, 0, 0);
         break;
     case 83: // mkdir
-        res = syscall(__NR_mkdirat, AT_FDCWD, arg0, arg1, 0, 0, 0);
+        res = emulate_host_syscall(__NR_mkdirat, AT_FDCWD, arg0, arg1, 0, 0, 0);
         break;
     case 84: // rmdir
-        res = syscall(__NR_unlinkat, AT_FDCWD, arg0, AT_REMOVEDIR, 0, 0, 0);
+        res = emulate_host_syscall(__NR_unlinkat, AT_FDCWD, arg0, AT_REMOVEDIR, 0, 0, 0);
         break;
     case 87: // unlink
-        res = syscall(__NR_unlinkat, AT_FDCWD, arg0, 0, 0, 0, 0);
+        res = emulate_host_syscall(__NR_unlinkat, AT_FDCWD, arg0, 0, 0, 0, 0);
         break;
     case 89: // readlink
-        res = syscall(__NR_readlinkat, AT_FDCWD, arg0, arg1, arg2, 0, 0);
+        res = emulate_host_syscall(__NR_readlinkat, AT_FDCWD, arg0, arg1, arg2, 0, 0);
         break;
     case 90: // chmod
-        res = syscall(__NR_fchmodat, AT_FDCWD, arg0, arg1, 0, 0, 0);
+        res = emulate_host_syscall(__NR_fchmodat, AT_FDCWD, arg0, arg1, 0, 0, 0);
         break;
     case 92: // chown
-        res = syscall(__NR_fchownat, AT_FDCWD, arg0, arg1, arg2, 0, 0);
+        res = emulate_host_syscall(__NR_fchownat, AT_FDCWD, arg0, arg1, arg2, 0, 0);
         break;
     case 94: // lchown
-        res = syscall(__NR_fchownat, AT_FDCWD, arg0, arg1, arg2,
+        res = emulate_host_syscall(__NR_fchownat, AT_FDCWD, arg0, arg1, arg2,
                       AT_SYMLINK_NOFOLLOW, 0);
         break;
 
@@ -588,7 +712,7 @@ void emulate_syscall(uint64_t *cpu_regs)
     case 262:
     { // newfstatat
         uintptr_t tmp_addr = (uintptr_t)&tmp_struct;
-        res = syscall(__NR_newfstatat, arg0, arg1, tmp_addr, arg3, 0, 0);
+        res = emulate_host_syscall(__NR_newfstatat, arg0, arg1, tmp_addr, arg3, 0, 0);
         arg1 = arg2;
         goto fstat_common;
     }
@@ -598,11 +722,11 @@ void emulate_syscall(uint64_t *cpu_regs)
     { // lstat
         uintptr_t tmp_addr = (uintptr_t)&tmp_struct;
         if (nr == 4) // stat
-            res = syscall(__NR_newfstatat, AT_FDCWD, arg0, tmp_addr, 0, 0, 0);
+            res = emulate_host_syscall(__NR_newfstatat, AT_FDCWD, arg0, tmp_addr, 0, 0, 0);
         else if (nr == 5) // fstat
-            res = syscall(__NR_fstat, arg0, tmp_addr, 0, 0, 0, 0);
+            res = emulate_host_syscall(__NR_fstat, arg0, tmp_addr, 0, 0, 0, 0);
         else if (nr == 6) // lstat
-            res = syscall(__NR_newfstatat, AT_FDCWD, arg0, tmp_addr, AT_SYMLINK_NOFOLLOW, 0, 0);
+            res = emulate_host_syscall(__NR_newfstatat, AT_FDCWD, arg0, tmp_addr, AT_SYMLINK_NOFOLLOW, 0, 0);
     fstat_common:
         if (res == 0)
         {
@@ -649,21 +773,21 @@ void emulate_syscall(uint64_t *cpu_regs)
         break;
     }
     case 7: // poll
-        res = syscall(__NR_ppoll, arg0, arg1, (long)arg2 >= 0 ? (uintptr_t) & ((struct timespec){arg2 / 1000, arg2 % 1000 * 1000000}) : 0,
+        res = emulate_host_syscall(__NR_ppoll, arg0, arg1, (long)arg2 >= 0 ? (uintptr_t) & ((struct timespec){arg2 / 1000, arg2 % 1000 * 1000000}) : 0,
                       0, _NSIG / 8, 0);
         break;
     case 33: // dup2
         if (arg0 == arg1)
         { // If oldfd == newfd return EBADF if oldfd is invalid
-            res = syscall(__NR_fcntl, arg0, F_GETFL, 0, 0, 0, 0);
+            res = emulate_host_syscall(__NR_fcntl, arg0, F_GETFL, 0, 0, 0, 0);
             if (res >= 0)
                 res = arg1;
             goto end;
         }
-        res = syscall(__NR_dup3, arg0, arg1, 0, 0, 0, 0);
+        res = emulate_host_syscall(__NR_dup3, arg0, arg1, 0, 0, 0, 0);
         break;
     case 34: // pause (wait for signal)
-        res = syscall(__NR_ppoll, 0, 0, 0, 0, 0, 0);
+        res = emulate_host_syscall(__NR_ppoll, 0, 0, 0, 0, 0, 0);
         break;
 
     case 72: // fcntl
@@ -713,7 +837,8 @@ void emulate_syscall(uint64_t *cpu_regs)
     case 201:
     { // time
         struct timespec ts;
-        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        emulate_host_syscall(__NR_clock_gettime, CLOCK_REALTIME_COARSE,
+                             (uintptr_t)&ts, 0, 0, 0, 0);
         if (arg0)
             *(long *)arg0 = ts.tv_sec;
         res = ts.tv_sec;
@@ -721,6 +846,7 @@ void emulate_syscall(uint64_t *cpu_regs)
     }
     
     case 231: {
+        emulate_exit_group(cpu_state);
         nr = __NR_exit_group;
         goto native;
     }
@@ -752,7 +878,7 @@ void emulate_syscall(uint64_t *cpu_regs)
         if (arg1 != sizeof(sigset_t))
             res = -EINVAL;
         else
-            res = syscall(__NR_rt_sigpending, arg0, arg1, 0, 0, 0, 0);
+            res = emulate_host_syscall(__NR_rt_sigpending, arg0, arg1, 0, 0, 0, 0);
         break;
     // case 128: // rt_sigtimedwait
     // case 129: // rt_sigqueueinfo
@@ -760,7 +886,7 @@ void emulate_syscall(uint64_t *cpu_regs)
         if (arg1 != sizeof(sigset_t))
             res = -EINVAL;
         else
-            res = syscall(__NR_rt_sigsuspend, arg0, arg1, 0, 0, 0, 0);
+            res = emulate_host_syscall(__NR_rt_sigsuspend, arg0, arg1, 0, 0, 0, 0);
         break;
     case 131: // sigaltstack
         res = signal_sigaltstack(cpu_state, (void *)arg0, (void *)arg1);
@@ -772,6 +898,7 @@ end:
     //         nr, arg0, arg1, arg2, arg3, arg4, arg5, res, res);
 
     cpu_regs[1] = res;
+    emulate_syscall_end(cpu_state, guest_nr, time_start);
 
     if (cpu_state->sigpending)
         signal_handle(cpu_state);
@@ -783,18 +910,20 @@ emulate_syscall_generic(struct CpuState *cpu_state, uint64_t *resp, uint64_t nr,
                         uint64_t arg3, uint64_t arg4, uint64_t arg5)
 {
     ssize_t res = -ENOSYS;
+    uint64_t guest_nr = nr;
+    uint64_t time_start = emulate_syscall_begin(cpu_state, guest_nr);
 
     switch (nr)
     {
         struct stat tmp_struct;
 
     native:
-        res = syscall(nr, arg0, arg1, arg2, arg3, arg4, arg5);
+        res = emulate_host_syscall(nr, arg0, arg1, arg2, arg3, arg4, arg5);
         break;
 
     default:
     unhandled:
-        res = unhandled_syscall(nr, arg0, arg1, arg2, arg3, arg4, arg5);
+        res = unhandled_syscall(cpu_state, guest_nr, arg0, arg1, arg2, arg3, arg4, arg5);
         break;
 
     case 17:
@@ -903,12 +1032,12 @@ emulate_syscall_generic(struct CpuState *cpu_state, uint64_t *resp, uint64_t nr,
         nr = __NR_readlinkat;
         goto native;
     case 80: // fstat
-        res = syscall(__NR_fstat, arg0, (uintptr_t)&tmp_struct, 0, 0, 0, 0);
+        res = emulate_host_syscall(__NR_fstat, arg0, (uintptr_t)&tmp_struct, 0, 0, 0, 0);
         arg2 = arg1;
         goto fstat_common;
     case 79:; // fstatat
         uintptr_t tmp_addr = (uintptr_t)&tmp_struct;
-        res = syscall(__NR_newfstatat, arg0, arg1, tmp_addr, arg3, 0, 0);
+        res = emulate_host_syscall(__NR_newfstatat, arg0, arg1, tmp_addr, arg3, 0, 0);
     fstat_common:
         if (res == 0)
         {
@@ -954,9 +1083,11 @@ emulate_syscall_generic(struct CpuState *cpu_state, uint64_t *resp, uint64_t nr,
         break;
 
     case 93:
+        stats_merge_thread(cpu_state);
         nr = __NR_exit;
         goto native;
     case 94:
+        emulate_exit_group(cpu_state);
         nr = __NR_exit_group;
         goto native;
     case 96:
@@ -984,7 +1115,7 @@ emulate_syscall_generic(struct CpuState *cpu_state, uint64_t *resp, uint64_t nr,
         nr = __NR_tgkill;
         goto native;
     case 160:
-        res = syscall(__NR_uname, arg0, 0, 0, 0, 0, 0);
+        res = emulate_host_syscall(__NR_uname, arg0, 0, 0, 0, 0, 0);
         if (res == 0)
         {
             // Emulate kernel 5.0.0 -- glibc checks kernel versions.
@@ -1030,8 +1161,10 @@ emulate_syscall_generic(struct CpuState *cpu_state, uint64_t *resp, uint64_t nr,
         nr = __NR_mremap;
         goto native;
     case 222:
-        nr = __NR_mmap;
-        goto native;
+        res = emulate_host_syscall(__NR_mmap, arg0, arg1, arg2, arg3, arg4, arg5);
+        if (replay_mode != REPLAY_REPLAY) // the file descriptor is not real
+            symbols_guest_mmap(res, arg1, arg2, arg3, arg4, arg5);
+        break;
     case 223:
         nr = __NR_fadvise64;
         goto native;
@@ -1081,7 +1214,7 @@ emulate_syscall_generic(struct CpuState *cpu_state, uint64_t *resp, uint64_t nr,
         if (arg1 != sizeof(sigset_t))
             res = -EINVAL;
         else
-            res = syscall(__NR_rt_sigpending, arg0, arg1, 0, 0, 0, 0);
+            res = emulate_host_syscall(__NR_rt_sigpending, arg0, arg1, 0, 0, 0, 0);
         break;
     // case 137: // rt_sigtimedwait
     // case 138: // rt_sigqueueinfo
@@ -1089,7 +1222,7 @@ emulate_syscall_generic(struct CpuState *cpu_state, uint64_t *resp, uint64_t nr,
         if (arg1 != sizeof(sigset_t))
             res = -EINVAL;
         else
-            res = syscall(__NR_rt_sigsuspend, arg0, arg1, 0, 0, 0, 0);
+            res = emulate_host_syscall(__NR_rt_sigsuspend, arg0, arg1, 0, 0, 0, 0);
         break;
     case 132: // sigaltstack
         res = signal_sigaltstack(cpu_state, (void *)arg0, (void *)arg1);
@@ -1097,6 +1230,7 @@ emulate_syscall_generic(struct CpuState *cpu_state, uint64_t *resp, uint64_t nr,
     }
 
     *resp = res;
+    emulate_syscall_end(cpu_state, guest_nr, time_start);
     return true;
 }
 
@@ -0,0 +1,52 @@
+#ifndef _INSTREW_RUNNER_LIVESTATS_SHM_H
+#define _INSTREW_RUNNER_LIVESTATS_SHM_H
+
+#include <stdint.h>
+
+// Layout of the live statistics segment, shared between the runner and the
+// instrew-stat reader. New fields are only appended; a reader must check the
+// version and can rely on the fields covered by size.
+#define LIVESTATS_SHM_PREFIX "/dev/shm/instrew-"
+#define LIVESTATS_SHM_MAGIC "INSTLIV1"
+#define LIVESTATS_SHM_VERSION 1
+
+struct LivestatsShm
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t size;
+    uint32_t pid;
+    // Sequence lock, odd while the runner updates the fields below.
+    _Atomic uint32_t seq;
+
+    uint64_t updates;
+    uint64_t interval_ms;
+    // CLOCK_MONOTONIC in nanoseconds.
+    uint64_t time_start;
+    uint64_t time_update;
+    // Set by the runner at a regular exit.
+    uint64_t exited;
+
+    uint64_t dispatches;
+    uint64_t tlb_misses;
+    uint64_t syscalls;
+
+    uint64_t resolves;
+    uint64_t loads;
+    uint64_t load_bytes;
+    uint64_t patches;
+
+    uint64_t rtld_objects;
+    uint64_t rtld_functions;
+    uint64_t rtld_code_bytes;
+    uint64_t rtld_rodata_bytes;
+
+    uint64_t mem_code_used;
+    uint64_t mem_code_committed;
+    uint64_t mem_rodata_used;
+    uint64_t mem_rodata_committed;
+    uint64_t mem_data_used;
+    uint64_t mem_data_committed;
+};
+
+#endif
@@ -0,0 +1,143 @@
+#include <stdatomic.h>
+#include <linux/mman.h>
+
+#include "common.h"
+#include "cpu-state.h"
+#include "livestats.h"
+#include "livestats-shm.h"
+#include "memory.h"
+#include "stats.h"
+
+static struct LivestatsShm *livestats_shm;
+static char livestats_path[sizeof(LIVESTATS_SHM_PREFIX) + 12];
+static uint64_t livestats_interval; // in ns
+static _Atomic uint64_t livestats_next;
+// Held by the thread writing the segment.
+static atomic_flag livestats_lock = ATOMIC_FLAG_INIT;
+
+// Per-thread counters of all threads, as far as published.
+static _Atomic uint64_t livestats_dispatches;
+static _Atomic uint64_t livestats_tlb_misses;
+static _Atomic uint64_t livestats_syscalls;
+
+static void
+livestats_update(const struct State *state, uint64_t now, bool exited)
+{
+    // Another thread is publishing right now, which is just as good, except
+    // for the final values.
+    while (atomic_flag_test_and_set_explicit(&livestats_lock, memory_order_acquire))
+        if (!exited)
+            return;
+    atomic_store_explicit(&livestats_next, now + livestats_interval, memory_order_relaxed);
+
+    struct LivestatsShm *shm = livestats_shm;
+    struct MemUsage usage;
+    mem_get_usage(&usage);
+
+    uint32_t seq = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+    atomic_store_explicit(&shm->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    shm->updates++;
+    shm->time_update = now;
+    shm->exited = exited;
+    shm->dispatches = atomic_load_explicit(&livestats_dispatches, memory_order_relaxed);
+    shm->tlb_misses = atomic_load_explicit(&livestats_tlb_misses, memory_order_relaxed);
+    shm->syscalls = atomic_load_explicit(&livestats_syscalls, memory_order_relaxed);
+    shm->resolves = state->stats.resolves;
+    shm->loads = state->stats.loads;
+    shm->load_bytes = state->stats.load_bytes;
+    shm->patches = state->stats.patches;
+    shm->rtld_objects = state->rtld.stats.objects;
+    shm->rtld_functions = state->rtld.stats.functions;
+    shm->rtld_code_bytes = state->rtld.stats.code_bytes;
+    shm->rtld_rodata_bytes = state->rtld.stats.rodata_bytes;
+    shm->mem_code_used = usage.code_used;
+    shm->mem_code_committed = usage.code_committed;
+    shm->mem_rodata_used = usage.rodata_used;
+    shm->mem_rodata_committed = usage.rodata_committed;
+    shm->mem_data_used = usage.data_used;
+    shm->mem_data_committed = usage.data_committed;
+
+    atomic_store_explicit(&shm->seq, seq + 2, memory_order_release);
+    atomic_flag_clear_explicit(&livestats_lock, memory_order_release);
+}
+
+void livestats_flush_thread(struct CpuState *cpu_state)
+{
+    struct StatsThread *ts = &cpu_state->stats;
+    if (!livestats_shm)
+        return;
+    atomic_fetch_add_explicit(&livestats_dispatches, ts->dispatches - ts->live_dispatches,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&livestats_tlb_misses, ts->tlb_misses - ts->live_tlb_misses,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&livestats_syscalls, ts->syscalls - ts->live_syscalls,
+                              memory_order_relaxed);
+    ts->live_dispatches = ts->dispatches;
+    ts->live_tlb_misses = ts->tlb_misses;
+    ts->live_syscalls = ts->syscalls;
+}
+
+void livestats_poll_slow(struct CpuState *cpu_state)
+{
+    if (!livestats_shm)
+        return;
+    cpu_state->stats.live_countdown = LIVESTATS_POLL_EVENTS;
+    uint64_t now = stats_now();
+    if (now < atomic_load_explicit(&livestats_next, memory_order_relaxed))
+        return;
+    livestats_flush_thread(cpu_state);
+    livestats_update(cpu_state->state, now, false);
+}
+
+int livestats_init(struct CpuState *cpu_state, unsigned interval_ms)
+{
+    if (!interval_ms)
+        return -EINVAL;
+
+    snprintf(livestats_path, sizeof(livestats_path), "%s%u",
+             LIVESTATS_SHM_PREFIX, getpid());
+    int fd = open(livestats_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return fd;
+    int ret = ftruncate(fd, sizeof(struct LivestatsShm));
+    if (ret < 0)
+        goto err_close;
+    struct LivestatsShm *shm = mmap(NULL, sizeof(struct LivestatsShm),
+                                    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (BAD_ADDR(shm))
+    {
+        ret = (int)(uintptr_t)shm;
+        goto err_close;
+    }
+    close(fd);
+
+    memcpy(shm->magic, LIVESTATS_SHM_MAGIC, sizeof(shm->magic));
+    shm->version = LIVESTATS_SHM_VERSION;
+    shm->size = sizeof(struct LivestatsShm);
+    shm->pid = getpid();
+    shm->interval_ms = interval_ms;
+    shm->time_start = stats_now();
+    livestats_shm = shm;
+    livestats_interval = interval_ms * 1000000ull;
+
+    livestats_update(cpu_state->state, shm->time_start, false);
+    cpu_state->stats.live_countdown = LIVESTATS_POLL_EVENTS;
+    return 0;
+
+err_close:
+    close(fd);
+    unlink(livestats_path);
+    return ret;
+}
+
+void livestats_finish(struct CpuState *cpu_state)
+{
+    if (!livestats_shm)
+        return;
+    livestats_flush_thread(cpu_state);
+    livestats_update(cpu_state->state, stats_now(), true);
+    // Readers which still have the segment mapped see the final values.
+    unlink(livestats_path);
+}
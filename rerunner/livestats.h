@@ -0,0 +1,33 @@
+#ifndef _INSTREW_RUNNER_LIVESTATS_H
+#define _INSTREW_RUNNER_LIVESTATS_H
+
+#include "common.h"
+#include "cpu-state.h"
+
+// Live statistics: the counters are periodically copied into a shared-memory
+// file (see livestats-shm.h). Threads publish from their slow paths, quick TLB
+// misses and syscalls, and only check the clock every LIVESTATS_POLL_EVENTS
+// of them, so the hot path only does its usual per-thread stores and the
+// guest is never interrupted. Values are not updated while the guest stays in
+// translated code.
+#define LIVESTATS_POLL_EVENTS 64
+
+int livestats_init(struct CpuState *cpu_state, unsigned interval_ms);
+// Add the counters of a thread that weren't published yet to the totals.
+// Called before they are merged into State::stats.
+void livestats_flush_thread(struct CpuState *cpu_state);
+// Publish the final values and remove the file.
+void livestats_finish(struct CpuState *cpu_state);
+
+void livestats_poll_slow(struct CpuState *cpu_state);
+
+// Called on the slow paths. Without live statistics, the countdown starts at
+// zero and practically never expires.
+static inline void
+livestats_poll(struct CpuState *cpu_state)
+{
+    if (UNLIKELY(--cpu_state->stats.live_countdown == 0))
+        livestats_poll_slow(cpu_state);
+}
+
+#endif
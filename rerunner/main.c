@@ -1,18 +1,187 @@
 #include <linux/mman.h>
 
 #include "common.h"
+#include "control.h"
 #include "elf-loader.h"
 #include "memory.h"
 #include "cpu-state.h"
 #include "dispatch.h"
 #include "emulate.h"
+#include "livestats.h"
+#include "perfctr.h"
+#include "profile.h"
+#include "replay.h"
+#include "sampler.h"
+#include "trace.h"
 
 #define MAX_ARG_LENGTH 256
 
 char dir_path[256];
+static char default_profile_path[sizeof(dir_path) + sizeof(PROFILE_FILE_NAME)];
+static char default_callgraph_path[sizeof(dir_path) + sizeof(PROFILE_CALLGRAPH_FILE_NAME)];
+static char samples_path[sizeof(dir_path) + sizeof(SAMPLER_FILE_NAME)];
+static char default_trace_path[sizeof(dir_path) + sizeof(TRACE_FILE_NAME)];
+static char default_replay_path[sizeof(dir_path) + sizeof(REPLAY_FILE_NAME)];
 
 int main(int argc, char **argv)
 {   
+    int retval;
+
+    struct State state = {0};
+    state.stats.time_main = stats_now();
+    state.stats.next_milestone = 1;
+    state.stats_fd = -1;
+    struct MemConfig mem_config = {
+        .grow_chunk = 0x100000,
+    };
+    // Profile to preload hot functions from; empty for the cache directory.
+    const char *preload_path = NULL;
+    bool perf_map = false;
+    bool perf_jitdump = false;
+    // Sampling frequency in Hz, 0 if disabled.
+    unsigned sample_freq = 0;
+    bool perfctr = false;
+    // Update interval of the live statistics in ms, 0 if disabled.
+    unsigned livestats_interval = 0;
+    // Event trace output; empty for the cache directory.
+    const char *trace_path = NULL;
+    struct TraceBuffer *trace = NULL;
+    bool control = false;
+    // Syscall log to record to or replay from; empty for the cache directory.
+    enum ReplayMode replay = REPLAY_OFF;
+    const char *replay_path = NULL;
+
+    // Options precede the cache directory.
+    while (argc > 2 && argv[1][0] == '-')
+    {
+        const char *opt = argv[1];
+        if (!strcmp(opt, "-hugepages"))
+        {
+            mem_config.hugepages_code = true;
+        }
+        else if (!strcmp(opt, "-hugepages=all"))
+        {
+            mem_config.hugepages_code = true;
+            mem_config.hugepages_data = true;
+        }
+        else if (!strncmp(opt, "-arenachunk=", 12))
+        {
+            // Size in bytes, optionally with K/M suffix.
+            char *end;
+            mem_config.grow_chunk = strtoul(opt + 12, &end, 0);
+            if (*end == 'K' || *end == 'k')
+                mem_config.grow_chunk <<= 10;
+            else if (*end == 'M' || *end == 'm')
+                mem_config.grow_chunk <<= 20;
+        }
+        else if (!strcmp(opt, "-prefault"))
+        {
+            mem_config.prefault = true;
+        }
+        else if (!strcmp(opt, "-preload"))
+        {
+            preload_path = "";
+        }
+        else if (!strncmp(opt, "-preload=", 9))
+        {
+            preload_path = opt + 9;
+        }
+        else if (!strcmp(opt, "-profile"))
+        {
+            state.profile_path = "";
+        }
+        else if (!strncmp(opt, "-profile=", 9))
+        {
+            state.profile_path = opt + 9;
+        }
+        else if (!strcmp(opt, "-callgraph"))
+        {
+            state.callgraph_path = "";
+        }
+        else if (!strncmp(opt, "-callgraph=", 11))
+        {
+            state.callgraph_path = opt + 11;
+        }
+        else if (!strcmp(opt, "-perf=map"))
+        {
+            perf_map = true;
+        }
+        else if (!strcmp(opt, "-perf=jitdump"))
+        {
+            perf_jitdump = true;
+        }
+        else if (!strcmp(opt, "-perf"))
+        {
+            perf_map = true;
+            perf_jitdump = true;
+        }
+        else if (!strcmp(opt, "-sample"))
+        {
+            sample_freq = 1000;
+        }
+        else if (!strncmp(opt, "-sample=", 8))
+        {
+            sample_freq = strtoul(opt + 8, NULL, 10);
+        }
+        else if (!strcmp(opt, "-perfctr"))
+        {
+            perfctr = true;
+        }
+        else if (!strcmp(opt, "-livestats"))
+        {
+            livestats_interval = 1000;
+        }
+        else if (!strncmp(opt, "-livestats=", 11))
+        {
+            livestats_interval = strtoul(opt + 11, NULL, 10);
+        }
+        else if (!strcmp(opt, "-control"))
+        {
+            control = true;
+        }
+        else if (!strcmp(opt, "-trace"))
+        {
+            trace_path = "";
+        }
+        else if (!strncmp(opt, "-trace=", 7))
+        {
+            trace_path = opt + 7;
+        }
+        else if (!strcmp(opt, "-record") || !strcmp(opt, "-replay"))
+        {
+            replay = opt[3] == 'c' ? REPLAY_RECORD : REPLAY_REPLAY;
+            replay_path = "";
+        }
+        else if (!strncmp(opt, "-record=", 8) || !strncmp(opt, "-replay=", 8))
+        {
+            replay = opt[3] == 'c' ? REPLAY_RECORD : REPLAY_REPLAY;
+            replay_path = opt + 8;
+        }
+        else if (!strcmp(opt, "-stats"))
+        {
+            state.stats_fd = 2;
+        }
+        else if (!strncmp(opt, "-stats=", 7))
+        {
+            state.stats_fd = open(opt + 7, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (state.stats_fd < 0)
+            {
+                dprintf(2, "error: could not open stats file %s\n", opt + 7);
+                return state.stats_fd;
+            }
+        }
+        else
+        {
+            dprintf(2, "error: unknown option %s\n", opt);
+            return -EINVAL;
+        }
+        argc--;
+        argv++;
+    }
+
+    if (perfctr && perfctr_init() == 0)
+        dprintf(2, "warning: no performance counters available\n");
+
     int len = strlen(argv[1]);
     if (argv[1][len - 1] != '/') {  // add '/' if argv[1] doesn't end with it
         argv[1][len] = '/';
@@ -20,6 +189,27 @@ int main(int argc, char **argv)
     }
 
     strncpy(dir_path, argv[1], sizeof(dir_path));
+    snprintf(default_profile_path, sizeof(default_profile_path), "%s%s",
+             dir_path, PROFILE_FILE_NAME);
+    if (state.profile_path && !*state.profile_path)
+        state.profile_path = default_profile_path;
+    snprintf(default_callgraph_path, sizeof(default_callgraph_path), "%s%s",
+             dir_path, PROFILE_CALLGRAPH_FILE_NAME);
+    if (state.callgraph_path && !*state.callgraph_path)
+        state.callgraph_path = default_callgraph_path;
+    snprintf(samples_path, sizeof(samples_path), "%s%s", dir_path,
+             SAMPLER_FILE_NAME);
+    snprintf(default_trace_path, sizeof(default_trace_path), "%s%s", dir_path,
+             TRACE_FILE_NAME);
+    if (trace_path && !*trace_path)
+        trace_path = default_trace_path;
+    snprintf(default_replay_path, sizeof(default_replay_path), "%s%s", dir_path,
+             REPLAY_FILE_NAME);
+    if (replay_path && !*replay_path)
+        replay_path = default_replay_path;
+    // Timestamps are relative to this point.
+    if (trace_path)
+        trace_init(trace_path);
     argv[1] = strcat(argv[1], "user_args"); // path to user_args
 
     int fd = open(argv[1], O_RDONLY, 0);
@@ -31,12 +221,9 @@ int main(int argc, char **argv)
     char *token = strtok(cmd_line, " ");
     int user_argc = atoi(token);
 
-    int retval;
-
-    struct State state = {0};
     signal_init(&state);
 
-    retval = mem_init();
+    retval = mem_init(&mem_config);
     if (retval < 0)
     {
         puts("error: failed to initialize heap");
@@ -52,7 +239,18 @@ int main(int argc, char **argv)
         return retval;
     }
 
-    const struct DispatcherInfo disp_info = dispatch_get();
+    if (state.profile_path)
+    {
+        retval = profile_table_init(&state.profile, 16);
+        if (retval < 0)
+        {
+            puts("error: failed to allocate profile");
+            return retval;
+        }
+    }
+
+    const struct DispatcherInfo disp_info = dispatch_get(state.profile_path != NULL,
+                                                         state.callgraph_path != NULL);
 
 #define STACK_SIZE 0x1000000
     int stack_prot = PROT_READ | PROT_WRITE;
@@ -120,11 +318,58 @@ int main(int argc, char **argv)
     *(--stack_top) = user_argc; // Argument Count
 
     retval = rtld_init(&state.rtld, &disp_info);
+    if (retval < 0)
+    {
+        puts("error: failed to initialize rtld");
+        return retval;
+    }
+    retval = rtld_perf_init(&state.rtld, perf_map, perf_jitdump);
+    if (retval < 0)
+    {
+        puts("error: failed to set up perf output");
+        return retval;
+    }
+
+    if (trace_path)
+    {
+        trace = trace_buffer_create();
+        if (BAD_ADDR(trace))
+        {
+            puts("error: failed to allocate trace buffer");
+            return (int)(uintptr_t)trace;
+        }
+    }
+
+    if (preload_path)
+    {
+        bool is_default = !*preload_path;
+        if (is_default)
+            preload_path = default_profile_path;
+        perfctr_phase(NULL, PERFCTR_PRELOAD);
+        retval = dispatch_preload(&state, trace, preload_path);
+        // Without a profile in the cache directory, just load on demand.
+        if (retval < 0 && !(is_default && retval == -ENOENT))
+        {
+            dprintf(2, "error: could not preload profile %s\n", preload_path);
+            return retval;
+        }
+    }
 
     struct CpuState *cpu_state = mem_alloc_data(sizeof(struct CpuState), _Alignof(struct CpuState));
     memset(cpu_state, 0, sizeof(*cpu_state));
     cpu_state->self = cpu_state;
     cpu_state->state = &state;
+    cpu_state->tid = gettid();
+    cpu_state->trace = trace;
+    if (state.callgraph_path)
+    {
+        retval = dispatch_callgraph_init(cpu_state);
+        if (retval < 0)
+        {
+            puts("error: failed to allocate call graph");
+            return retval;
+        }
+    }
 
     set_thread_area(cpu_state);
 
@@ -132,6 +377,48 @@ int main(int argc, char **argv)
     cpu_regs[0] = (uintptr_t)info.exec_entry;
     cpu_regs[33] = (uintptr_t)stack_top;
 
+    if (sample_freq)
+    {
+        retval = sampler_init(sample_freq, samples_path);
+        if (retval < 0)
+        {
+            puts("error: failed to start sampler");
+            return retval;
+        }
+    }
+
+    if (livestats_interval)
+    {
+        retval = livestats_init(cpu_state, livestats_interval);
+        if (retval < 0)
+        {
+            puts("error: failed to set up live statistics");
+            return retval;
+        }
+    }
+
+    if (control)
+    {
+        retval = control_init(cpu_state);
+        if (retval < 0)
+        {
+            puts("error: failed to set up control channel");
+            return retval;
+        }
+    }
+
+    if (replay != REPLAY_OFF)
+    {
+        retval = replay_init(replay, replay_path);
+        if (retval < 0)
+        {
+            dprintf(2, "error: could not open syscall log %s\n", replay_path);
+            return retval;
+        }
+    }
+
+    perfctr_phase(cpu_state, PERFCTR_DISPATCH);
+    state.stats.time_guest = stats_now();
     disp_info.loop_func(cpu_regs);
 
     return 0;
@@ -1,6 +1,7 @@
 #include <elf.h>
 #include <linux/fcntl.h>
 #include <linux/fs.h>
+#include <linux/memfd.h>
 #include <linux/mman.h>
 
 #include "common.h"
@@ -9,6 +10,18 @@
 #define MEM_BASE ((void *)0x0000400000000000ull)
 #define MEM_CODE_SIZE 0x40000000
 #define MEM_DATA_SIZE 0x01000000
+// Read-only data of linked objects directly follows the code arena, so that
+// PC-relative references from code (+-2 GiB on x86-64) are always in range.
+#define MEM_RODATA_SIZE 0x10000000
+
+#define MEM_HUGE_PAGE_SIZE 0x200000
+
+enum ArenaHuge
+{
+    ARENA_HUGE_NONE,
+    ARENA_HUGE_TLB, // MAP_HUGETLB/MFD_HUGETLB, reserved up front
+    ARENA_HUGE_THP, // MADV_HUGEPAGE, best effort
+};
 
 typedef struct Arena Arena;
 struct Arena
@@ -17,61 +30,287 @@ struct Arena
     char *end;
     char *brk;
     char *brkp;
+
+    // For dual-mapped arenas: backing memfd and offset from the executable
+    // mapping to the writable alias. Otherwise -1 and 0.
+    int fd;
+    ptrdiff_t write_offset;
+
+    // Granularity in which brkp grows; the huge page size for huge arenas.
+    size_t pagesize;
+    enum ArenaHuge huge;
+    // Minimum amount by which brkp grows, a multiple of pagesize.
+    size_t chunk;
+    // Minimum alignment of allocations.
+    size_t min_align;
+    // Populate page tables for newly committed memory.
+    bool prefault;
+
+    // Statistics
+    size_t grow_count;
+    size_t syscall_count;
+    size_t prefaulted;
 };
 
-static int
-arena_init(Arena *arena, void *base, size_t size)
+static void
+arena_setup(Arena *arena, void *mem, size_t size, enum ArenaHuge huge)
 {
-    void *mem = mmap(base, size, PROT_NONE,
-                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
-    if (BAD_ADDR(mem))
-        return (int)(uintptr_t)mem;
-
     arena->start = mem;
     arena->end = (char *)mem + size;
     arena->brk = mem;
     arena->brkp = mem;
+    arena->fd = -1;
+    arena->write_offset = 0;
+    arena->pagesize = huge != ARENA_HUGE_NONE ? MEM_HUGE_PAGE_SIZE : getpagesize();
+    arena->huge = huge;
+    arena->chunk = arena->pagesize;
+    arena->min_align = 0x40;
+    arena->prefault = false;
+    arena->grow_count = 0;
+    arena->syscall_count = 0;
+    arena->prefaulted = 0;
+}
+
+static void
+arena_configure(Arena *arena, const struct MemConfig *config)
+{
+    if (config->grow_chunk > arena->chunk)
+        arena->chunk = ALIGN_UP(config->grow_chunk, arena->pagesize);
+    arena->prefault = config->prefault;
+}
+
+static int
+arena_init(Arena *arena, void *base, size_t size, bool huge)
+{
+    void *mem;
+    if (huge)
+    {
+        // Explicit huge pages are reserved at mmap time, so no later fault can
+        // fail. If there are not enough of them, try transparent huge pages.
+        mem = mmap(base, size, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (!BAD_ADDR(mem))
+        {
+            arena_setup(arena, mem, size, ARENA_HUGE_TLB);
+            return 0;
+        }
+    }
+
+    mem = mmap(base, size, PROT_NONE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (BAD_ADDR(mem))
+        return (int)(uintptr_t)mem;
+
+    if (huge && madvise(mem, size, MADV_HUGEPAGE) == 0)
+        arena_setup(arena, mem, size, ARENA_HUGE_THP);
+    else
+        arena_setup(arena, mem, size, ARENA_HUGE_NONE);
 
     return 0;
 }
 
+static int
+arena_map_dual(Arena *arena, void *base, size_t size, int prot, int fd,
+               enum ArenaHuge huge)
+{
+    void *mem = mmap(base, size, prot, MAP_SHARED, fd, 0);
+    if (BAD_ADDR(mem))
+        return (int)(uintptr_t)mem;
+    void *alias = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (BAD_ADDR(alias))
+    {
+        munmap(mem, size);
+        return (int)(uintptr_t)alias;
+    }
+
+    if (huge == ARENA_HUGE_THP)
+    {
+        // Only has an effect if shmem THP is enabled ("advise" or "always").
+        if (madvise(mem, size, MADV_HUGEPAGE) < 0 ||
+            madvise(alias, size, MADV_HUGEPAGE) < 0)
+            huge = ARENA_HUGE_NONE;
+    }
+
+    arena_setup(arena, mem, size, huge);
+    arena->fd = fd;
+    arena->write_offset = (char *)alias - (char *)mem;
+
+    return 0;
+}
+
+// Whether transparent huge pages can be used for shared memory (memfd).
+static bool
+mem_shmem_thp_enabled(void)
+{
+    int fd = open("/sys/kernel/mm/transparent_hugepage/shmem_enabled",
+                  O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+    char buf[128];
+    ssize_t ret = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (ret <= 0)
+        return false;
+    buf[ret] = '\0';
+    // The active setting is in brackets, e.g. "always [never] deny".
+    const char *active = strchr(buf, '[');
+    return active && strncmp(active, "[never]", 7) && strncmp(active, "[deny]", 6);
+}
+
+// Map a memfd twice: with prot (read-only or read-execute) at base and
+// read-write somewhere else, so that no page is ever writable and executable
+// at the same time, and read-only data stays read-only. Both views
+// cover the whole arena from the beginning; pages are only allocated by the
+// kernel on first write, so growing the arena needs no mprotect.
+static int
+arena_init_dual(Arena *arena, const char *name, void *base, size_t size,
+                int prot, bool huge)
+{
+    int ret;
+    if (huge)
+    {
+        // The shared mappings reserve all huge pages up front, so this only
+        // succeeds if the huge page pool is large enough for the arena.
+        int fd = memfd_create(name, MFD_CLOEXEC | MFD_HUGETLB | MFD_HUGE_2MB);
+        if (fd >= 0)
+        {
+            ret = ftruncate(fd, size);
+            if (ret == 0)
+                ret = arena_map_dual(arena, base, size, prot, fd, ARENA_HUGE_TLB);
+            if (ret == 0)
+                return 0;
+            close(fd);
+        }
+
+        // Without shmem THP, MADV_HUGEPAGE has no effect on a memfd. Use
+        // small pages rather than giving up the dual mapping for an anonymous
+        // one, which would have to be writable and executable.
+        if (!mem_shmem_thp_enabled())
+            huge = false;
+    }
+
+    int fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd < 0)
+        return fd;
+    ret = ftruncate(fd, size);
+    if (ret == 0)
+        ret = arena_map_dual(arena, base, size, prot, fd,
+                             huge ? ARENA_HUGE_THP : ARENA_HUGE_NONE);
+    if (ret < 0)
+        close(fd);
+    return ret;
+}
+
+// Commit at least minsize bytes at brkp, rounded up to the growth chunk, and
+// optionally prefault them.
+static int
+arena_grow(Arena *arena, size_t minsize, bool exec)
+{
+    size_t avail = arena->end - arena->brkp;
+    size_t grow = ALIGN_UP(minsize, arena->pagesize);
+    if (grow > avail)
+        return -ENOMEM;
+    if (grow < arena->chunk)
+        grow = arena->chunk < avail ? arena->chunk : avail;
+
+    // Dual-mapped arenas are accessible in their entirety already.
+    if (arena->fd < 0)
+    {
+        int prot = PROT_READ | PROT_WRITE | (exec ? PROT_EXEC : 0);
+        int ret = mprotect(arena->brkp, grow, prot);
+        arena->syscall_count++;
+        if (ret < 0)
+            return ret;
+    }
+
+    if (arena->prefault)
+    {
+        char *wr = arena->brkp + arena->write_offset;
+        arena->syscall_count++;
+        if (madvise(wr, grow, MADV_POPULATE_WRITE) < 0)
+        {
+            // Before Linux 5.14; fault in the pages one by one. The memory
+            // is fresh, so writing zeroes doesn't change anything.
+            for (size_t off = 0; off < grow; off += getpagesize())
+                *(volatile char *)(wr + off) = 0;
+        }
+        arena->prefaulted += grow;
+    }
+
+    arena->grow_count++;
+    arena->brkp += grow;
+    return 0;
+}
+
 static void *
 arena_alloc(Arena *arena, size_t size, size_t alignment, bool exec)
 {
-    if (alignment < 0x40)
-        alignment = 0x40;
+    if (alignment < arena->min_align)
+        alignment = arena->min_align;
     if (alignment & (alignment - 1))
         return (void *)(uintptr_t)-EINVAL;
     char *brk_al = (char *)ALIGN_UP((uintptr_t)arena->brk, alignment);
-    if (brk_al + size <= arena->brkp)
-    { // easy case.
-        arena->brk = brk_al + size;
-        return brk_al;
+    if (brk_al + size > arena->brkp)
+    {
+        int ret = arena_grow(arena, brk_al + size - arena->brkp, exec);
+        if (ret < 0)
+            return (void *)(uintptr_t)ret;
     }
-    size_t newpgsz = ALIGN_UP(size - (arena->brkp - brk_al), getpagesize());
-    if (arena->brk + newpgsz > arena->end)
-        return (void *)(uintptr_t)-ENOMEM;
-    int prot = PROT_READ | PROT_WRITE | (exec ? PROT_EXEC : 0);
-    int ret = mprotect(arena->brkp, newpgsz, prot);
-    if (ret < 0)
-        return (void *)(uintptr_t)ret;
-    arena->brkp += newpgsz;
     arena->brk = brk_al + size;
     return brk_al;
 }
 
 Arena main_arena_code;
+Arena main_arena_rodata;
 Arena main_arena_data;
 
-int mem_init(void)
+static struct rusage mem_init_rusage;
+
+#if defined(__aarch64__)
+static void mem_cache_init(void);
+#endif
+
+int mem_init(const struct MemConfig *config)
 {
-    int ret = arena_init(&main_arena_data, MEM_BASE, MEM_DATA_SIZE);
+    getrusage(RUSAGE_SELF, &mem_init_rusage);
+#if defined(__aarch64__)
+    mem_cache_init();
+#endif
+
+    int ret = arena_init(&main_arena_data, MEM_BASE, MEM_DATA_SIZE,
+                         config->hugepages_data);
     if (ret)
         return ret;
     void *code_arena_base = (void *)((uintptr_t)MEM_BASE + MEM_DATA_SIZE);
-    ret = arena_init(&main_arena_code, code_arena_base, MEM_CODE_SIZE);
+    ret = arena_init_dual(&main_arena_code, "instrew-code", code_arena_base,
+                          MEM_CODE_SIZE, PROT_READ | PROT_EXEC,
+                          config->hugepages_code);
     if (ret)
-        return ret;
+    {
+        // No memfd support (or not allowed), fall back to an RWX mapping.
+        ret = arena_init(&main_arena_code, code_arena_base, MEM_CODE_SIZE,
+                         config->hugepages_code);
+        if (ret)
+            return ret;
+    }
+    void *rodata_arena_base = (void *)((uintptr_t)code_arena_base + MEM_CODE_SIZE);
+    ret = arena_init_dual(&main_arena_rodata, "instrew-rodata",
+                          rodata_arena_base, MEM_RODATA_SIZE, PROT_READ,
+                          /*huge=*/false);
+    if (ret)
+    {
+        // Without memfd, read-only data has to be writable at its address.
+        ret = arena_init(&main_arena_rodata, rodata_arena_base,
+                         MEM_RODATA_SIZE, /*huge=*/false);
+        if (ret)
+            return ret;
+    }
+    arena_configure(&main_arena_data, config);
+    arena_configure(&main_arena_code, config);
+    arena_configure(&main_arena_rodata, config);
+    // Code and read-only data are packed as densely as their sections allow.
+    main_arena_code.min_align = 1;
+    main_arena_rodata.min_align = 1;
     return 0;
 }
 
@@ -87,22 +326,278 @@ mem_alloc_code(size_t size, size_t alignment)
     return arena_alloc(&main_arena_code, size, alignment, /*exec=*/true);
 }
 
+// Patch stubs are created one at a time whenever a call site is patched, long
+// after the code of their object was placed. They are packed into blocks of
+// their own, so that they don't split up objects loaded later and stubs used
+// together share cache lines.
+#define MEM_STUB_BLOCK_SIZE 0x1000
+
+static char *mem_stub_next;
+static char *mem_stub_end;
+static size_t mem_stub_blocks;
+static size_t mem_stub_count;
+
+void *
+mem_alloc_stub(size_t size, size_t alignment)
+{
+    char *stub = (char *)ALIGN_UP((uintptr_t)mem_stub_next, alignment);
+    if (!mem_stub_next || stub + size > mem_stub_end)
+    {
+        char *block = arena_alloc(&main_arena_code, MEM_STUB_BLOCK_SIZE, 0x40,
+                                  /*exec=*/true);
+        if (BAD_ADDR(block))
+            return block;
+        mem_stub_end = block + MEM_STUB_BLOCK_SIZE;
+        mem_stub_blocks++;
+        stub = block;
+    }
+    mem_stub_next = stub + size;
+    mem_stub_count++;
+    return stub;
+}
+
+const void *mem_code_start(void)
+{
+    return main_arena_code.start;
+}
+
+bool mem_code_contains(uintptr_t addr)
+{
+    return addr >= (uintptr_t)main_arena_code.start &&
+           addr < (uintptr_t)main_arena_code.brk;
+}
+
+void mem_code_new_region(void)
+{
+    arena_alloc(&main_arena_code, 0, getpagesize(), /*exec=*/true);
+}
+
+void *
+mem_alloc_rodata(size_t size, size_t alignment)
+{
+    return arena_alloc(&main_arena_rodata, size, alignment, /*exec=*/false);
+}
+
+int mem_write_rodata(void *dst, const void *src, size_t size)
+{
+    memcpy((char *)dst + main_arena_rodata.write_offset, src, size);
+    return 0;
+}
+
+#if defined(__aarch64__)
+// Cache properties from CTR_EL0, read in mem_init. On systems with
+// heterogeneous cores, the kernel reports the smallest line sizes.
+static size_t mem_dcache_line;
+static size_t mem_icache_line;
+static bool mem_dcache_clean_pou; // CTR_EL0.IDC: no D-cache clean needed
+static bool mem_icache_coherent;  // CTR_EL0.DIC: no I-cache invalidate needed
+
+// Ranges of code written since the last mem_flush_code. Patching writes both
+// a stub in a stub block and the call site in object code, so keep several
+// disjoint ranges instead of maintaining everything in between.
+#define MEM_DIRTY_RANGES 8
+#define MEM_DIRTY_GAP 0x100
+static struct
+{
+    uintptr_t start;
+    uintptr_t end;
+} mem_dirty[MEM_DIRTY_RANGES];
+static size_t mem_dirty_count;
+
+static void
+mem_cache_init(void)
+{
+    uint64_t ctr;
+    __asm__ volatile("mrs %0, ctr_el0"
+                     : "=r"(ctr));
+    mem_dcache_line = 4 << ((ctr >> 16) & 0xf);
+    mem_icache_line = 4 << (ctr & 0xf);
+    mem_dcache_clean_pou = ctr & (1ul << 28);
+    mem_icache_coherent = ctr & (1ul << 29);
+}
+#endif
+
 int mem_write_code(void *dst, const void *src, size_t size)
 {
-    // Note: if W^X is enforced, the pages need to be mapped somewhere else for
-    // writing (e.g., using memfd).
-    memcpy(dst, src, size);
+    // If the code arena is dual-mapped, write through the writable alias.
+    memcpy((char *)dst + main_arena_code.write_offset, src, size);
 
-    // Flush ICache, except for x86-64.
+    // Cache maintenance is deferred to mem_flush_code, so that all writes for
+    // one object or a batch of patches are made visible at once.
+#if defined(__aarch64__)
+    uintptr_t start = (uintptr_t)dst;
+    uintptr_t end = start + size;
+    for (size_t i = 0; i < mem_dirty_count; i++)
+    {
+        if (start <= mem_dirty[i].end + MEM_DIRTY_GAP &&
+            end + MEM_DIRTY_GAP >= mem_dirty[i].start)
+        {
+            if (start < mem_dirty[i].start)
+                mem_dirty[i].start = start;
+            if (end > mem_dirty[i].end)
+                mem_dirty[i].end = end;
+            return 0;
+        }
+    }
+    if (mem_dirty_count == MEM_DIRTY_RANGES)
+        mem_flush_code();
+    mem_dirty[mem_dirty_count].start = start;
+    mem_dirty[mem_dirty_count].end = end;
+    mem_dirty_count++;
+#endif
+    return 0;
+}
+
+void mem_flush_code(void)
+{
 #if defined(__x86_64__)
-    // Do nothing; x86-64 flushes ICache automatically.
+    // Do nothing; x86-64 keeps the ICache coherent automatically.
 #elif defined(__aarch64__)
-    for (size_t off = 0; off < size; off += 16)
-        __asm__ volatile("ic ivau, %0"
-                         :
-                         : "r"((uint8_t *)dst + off));
+    if (!mem_dirty_count)
+        return;
+
+    // Clean D-cache to the point of unification, then invalidate the I-cache,
+    // see "Synchronization and coherency issues between data and instruction
+    // accesses" in the Arm ARM. Both operations work on the executable
+    // mapping; data caches are physically tagged, so this covers the writes
+    // through the writable alias as well.
+    if (!mem_dcache_clean_pou)
+    {
+        for (size_t i = 0; i < mem_dirty_count; i++)
+        {
+            uintptr_t addr = ALIGN_DOWN(mem_dirty[i].start, mem_dcache_line);
+            for (; addr < mem_dirty[i].end; addr += mem_dcache_line)
+                __asm__ volatile("dc cvau, %0"
+                                 :
+                                 : "r"(addr)
+                                 : "memory");
+        }
+    }
+    __asm__ volatile("dsb ish" ::: "memory");
+    if (!mem_icache_coherent)
+    {
+        for (size_t i = 0; i < mem_dirty_count; i++)
+        {
+            uintptr_t addr = ALIGN_DOWN(mem_dirty[i].start, mem_icache_line);
+            for (; addr < mem_dirty[i].end; addr += mem_icache_line)
+                __asm__ volatile("ic ivau, %0"
+                                 :
+                                 : "r"(addr)
+                                 : "memory");
+        }
+        __asm__ volatile("dsb ish" ::: "memory");
+    }
+    __asm__ volatile("isb" ::: "memory");
+
+    mem_dirty_count = 0;
 #else
 #error "Implement ICache flush for unknown target"
 #endif
-    return 0;
+}
+
+// Sum of memory mapped with huge pages (THP or hugetlbfs) in mappings that
+// start inside [start, end), according to /proc/self/smaps.
+static size_t
+mem_huge_mapped(const char *start, const char *end)
+{
+    int fd = open("/proc/self/smaps", O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+        return 0;
+
+    static const char *const fields[] = {
+        "AnonHugePages:", "ShmemPmdMapped:", "Shared_Hugetlb:",
+        "Private_Hugetlb:", NULL,
+    };
+
+    size_t total = 0;
+    bool in_range = false;
+    char buf[4096];
+    size_t buflen = 0;
+    while (true)
+    {
+        ssize_t ret = read(fd, buf + buflen, sizeof(buf) - buflen - 1);
+        if (ret <= 0)
+            break;
+        buflen += ret;
+        buf[buflen] = '\0';
+
+        char *line = buf;
+        char *eol;
+        while ((eol = strchr(line, '\n')))
+        {
+            *eol = '\0';
+            if ((line[0] >= '0' && line[0] <= '9') || (line[0] >= 'a' && line[0] <= 'f'))
+            {
+                // Mapping header: "start-end perms offset dev inode path"
+                uintptr_t vma_start = strtoul(line, NULL, 16);
+                in_range = vma_start >= (uintptr_t)start && vma_start < (uintptr_t)end;
+            }
+            else if (in_range)
+            {
+                for (size_t i = 0; fields[i]; i++)
+                {
+                    size_t len = strlen(fields[i]);
+                    if (!strncmp(line, fields[i], len))
+                        total += strtoul(line + len, NULL, 10) * 1024;
+                }
+            }
+            line = eol + 1;
+        }
+
+        buflen -= line - buf;
+        memcpy(buf, line, buflen);
+        if (buflen == sizeof(buf) - 1) // overlong line, drop it
+            buflen = 0;
+    }
+
+    close(fd);
+    return total;
+}
+
+static void
+mem_print_arena_stats(int fd, const char *name, const Arena *arena)
+{
+    static const char *const huge_names[] = {
+        [ARENA_HUGE_NONE] = "none",
+        [ARENA_HUGE_TLB] = "hugetlb",
+        [ARENA_HUGE_THP] = "thp",
+    };
+
+    dprintf(fd, "mem.%s.used: %lu\n", name, (size_t)(arena->brk - arena->start));
+    dprintf(fd, "mem.%s.committed: %lu\n", name, (size_t)(arena->brkp - arena->start));
+    dprintf(fd, "mem.%s.grows: %lu\n", name, arena->grow_count);
+    dprintf(fd, "mem.%s.grow_syscalls: %lu\n", name, arena->syscall_count);
+    dprintf(fd, "mem.%s.prefaulted: %lu\n", name, arena->prefaulted);
+    dprintf(fd, "mem.%s.hugepages: %s\n", name, huge_names[arena->huge]);
+    dprintf(fd, "mem.%s.huge_mapped: %lu\n", name,
+            mem_huge_mapped(arena->start, arena->end));
+}
+
+void mem_get_usage(struct MemUsage *usage)
+{
+    usage->code_used = main_arena_code.brk - main_arena_code.start;
+    usage->code_committed = main_arena_code.brkp - main_arena_code.start;
+    usage->rodata_used = main_arena_rodata.brk - main_arena_rodata.start;
+    usage->rodata_committed = main_arena_rodata.brkp - main_arena_rodata.start;
+    usage->data_used = main_arena_data.brk - main_arena_data.start;
+    usage->data_committed = main_arena_data.brkp - main_arena_data.start;
+}
+
+void mem_print_stats(int fd)
+{
+    mem_print_arena_stats(fd, "code", &main_arena_code);
+    dprintf(fd, "mem.code.stub_blocks: %lu\n", mem_stub_blocks);
+    dprintf(fd, "mem.code.stubs: %lu\n", mem_stub_count);
+    mem_print_arena_stats(fd, "rodata", &main_arena_rodata);
+    mem_print_arena_stats(fd, "data", &main_arena_data);
+
+    // Page faults of the whole process since the arenas were set up.
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+    {
+        dprintf(fd, "mem.faults.minor: %lu\n",
+                (size_t)(ru.ru_minflt - mem_init_rusage.ru_minflt));
+        dprintf(fd, "mem.faults.major: %lu\n",
+                (size_t)(ru.ru_majflt - mem_init_rusage.ru_majflt));
+    }
 }
@@ -3,11 +3,52 @@
 
 #include "common.h"
 
-int mem_init(void);
+struct MemConfig
+{
+    // Back the code arena with 2 MiB pages.
+    bool hugepages_code;
+    // Back the data arena (including the rtld table) with 2 MiB pages.
+    bool hugepages_data;
+    // Minimum size by which an arena grows when it runs out of memory.
+    size_t grow_chunk;
+    // Prefault newly committed memory (MADV_POPULATE_WRITE).
+    bool prefault;
+};
+
+int mem_init(const struct MemConfig *config);
 
 void *mem_alloc_data(size_t size, size_t alignment);
 
 void *mem_alloc_code(size_t size, size_t alignment);
+// Allocate a small stub that is created independently of object code.
+void *mem_alloc_stub(size_t size, size_t alignment);
 int mem_write_code(void *dst, const void *src, size_t size);
+// Make code written with mem_write_code visible to instruction fetch.
+void mem_flush_code(void);
+// Start a new region for subsequent code allocations, which won't share pages
+// with earlier ones. Used to separate hot from cold code.
+void mem_code_new_region(void);
+// Start of the code arena.
+const void *mem_code_start(void);
+// Whether addr points into the code arena.
+bool mem_code_contains(uintptr_t addr);
+
+// Read-only data of linked code, close enough for PC-relative references.
+void *mem_alloc_rodata(size_t size, size_t alignment);
+int mem_write_rodata(void *dst, const void *src, size_t size);
+
+struct MemUsage
+{
+    size_t code_used;
+    size_t code_committed;
+    size_t rodata_used;
+    size_t rodata_committed;
+    size_t data_used;
+    size_t data_committed;
+};
+
+// Current arena usage; safe to call from a signal handler.
+void mem_get_usage(struct MemUsage *usage);
+void mem_print_stats(int fd);
 
-#endif
\ No newline at end of file
+#endif
@@ -318,6 +318,18 @@ ssize_t write(int fd, const void* buf, size_t count) {
 int close(int fd) {
     return syscall1(__NR_close, fd);
 }
+int ftruncate(int fd, off_t length) {
+    return syscall2(__NR_ftruncate, fd, length);
+}
+int memfd_create(const char* name, unsigned flags) {
+    return syscall2(__NR_memfd_create, (size_t) name, flags);
+}
+int unlink(const char* pathname) {
+    return syscall3(__NR_unlinkat, AT_FDCWD, (size_t) pathname, 0);
+}
+ssize_t readlinkat(int dirfd, const char* pathname, char* buf, size_t bufsiz) {
+    return syscall4(__NR_readlinkat, dirfd, (size_t) pathname, (size_t) buf, bufsiz);
+}
 
 ssize_t read_full(int fd, void* buf, size_t nbytes) {
     size_t total_read = 0;
@@ -362,6 +374,9 @@ int mprotect(void* addr, size_t len, int prot) {
 int munmap(void* addr, size_t length) {
     return syscall2(__NR_munmap, (size_t) addr, length);
 }
+int madvise(void* addr, size_t len, int advice) {
+    return syscall3(__NR_madvise, (size_t) addr, len, advice);
+}
 
 int clock_gettime(int clk_id, struct timespec* tp) {
     return syscall2(__NR_clock_gettime, clk_id, (size_t) tp);
@@ -371,6 +386,22 @@ int nanosleep(const struct timespec* req, struct timespec* rem) {
     return syscall2(__NR_nanosleep, (uintptr_t) req, (uintptr_t) rem);
 }
 
+int getrusage(int who, struct rusage* usage) {
+    return syscall2(__NR_getrusage, who, (uintptr_t) usage);
+}
+
+int setitimer(int which, const struct itimerval* new_value,
+              struct itimerval* old_value) {
+    return syscall3(__NR_setitimer, which, (uintptr_t) new_value,
+                    (uintptr_t) old_value);
+}
+
+int perf_event_open(struct perf_event_attr* attr, pid_t pid, int cpu,
+                    int group_fd, unsigned long flags) {
+    return syscall6(__NR_perf_event_open, (uintptr_t) attr, pid, cpu,
+                    group_fd, flags, 0);
+}
+
 __attribute__((noreturn))
 void _exit(int status) {
     syscall1(__NR_exit, status);
@@ -582,6 +613,24 @@ printf_driver(PrintfWriteFunc write_func, void* data, const char* format,
             write_func(data, buffer, buflen);
             bytes_written += buflen;
         }
+        else if (format_spec == 'l' && *format == 'u') {
+            format++;
+
+            size_t value = va_arg(args, size_t);
+            size_t buf_idx = sizeof(buffer) - 1;
+            if (value == 0) {
+                buffer[buf_idx] = '0';
+            }
+            else {
+                while (value > 0) {
+                    buffer[buf_idx--] = '0' + value % 10;
+                    value /= 10;
+                }
+                buf_idx++;
+            }
+            write_func(data, buffer + buf_idx, sizeof(buffer) - buf_idx);
+            bytes_written += sizeof(buffer) - buf_idx;
+        }
         else if (format_spec == 'l' && *format == 'x') {
             format++;
 
@@ -879,6 +928,72 @@ int atoi(const char* str) {
     return result * sign;
 }
 
+unsigned long strtoul(const char* str, char** endptr, int base) {
+    unsigned long result = 0;
+    const char* p = str;
+
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if ((base == 0 || base == 16) && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        p += 2;
+        base = 16;
+    } else if (base == 0) {
+        base = p[0] == '0' ? 8 : 10;
+    }
+
+    for (;; p++) {
+        int digit;
+        if (*p >= '0' && *p <= '9')
+            digit = *p - '0';
+        else if (*p >= 'a' && *p <= 'z')
+            digit = *p - 'a' + 10;
+        else if (*p >= 'A' && *p <= 'Z')
+            digit = *p - 'A' + 10;
+        else
+            break;
+        if (digit >= base)
+            break;
+        result = result * base + digit;
+    }
+
+    if (endptr)
+        *endptr = (char*) p;
+    return result;
+}
+
+static void qsort_swap(char* a, char* b, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        char tmp = a[i];
+        a[i] = b[i];
+        b[i] = tmp;
+    }
+}
+
+static void qsort_sift_down(char* base, size_t root, size_t nmemb, size_t size,
+                            int (*compar)(const void*, const void*)) {
+    while (2 * root + 1 < nmemb) {
+        size_t child = 2 * root + 1;
+        if (child + 1 < nmemb && compar(base + child * size, base + (child + 1) * size) < 0)
+            child++;
+        if (compar(base + root * size, base + child * size) >= 0)
+            return;
+        qsort_swap(base + root * size, base + child * size, size);
+        root = child;
+    }
+}
+
+// Heapsort: in-place and without recursion, but not stable.
+void qsort(void* base, size_t nmemb, size_t size,
+           int (*compar)(const void*, const void*)) {
+    char* b = base;
+    for (size_t i = nmemb / 2; i-- > 0;)
+        qsort_sift_down(b, i, nmemb, size, compar);
+    for (size_t end = nmemb; end-- > 1;) {
+        qsort_swap(b, b + end * size, size);
+        qsort_sift_down(b, 0, end, size, compar);
+    }
+}
+
 __attribute__((noreturn))
 GNU_FORCE_EXTERN
 void
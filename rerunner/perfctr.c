@@ -0,0 +1,161 @@
+#include <linux/perf_event.h>
+
+#include "common.h"
+#include "cpu-state.h"
+#include "perfctr.h"
+
+#define PERFCTR_CACHE(cache, op, result) \
+    ((cache) | ((op) << 8) | ((result) << 16))
+
+struct PerfctrEvent
+{
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+};
+
+static const struct PerfctrEvent perfctr_events[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"itlb_misses", PERF_TYPE_HW_CACHE,
+     PERFCTR_CACHE(PERF_COUNT_HW_CACHE_ITLB, PERF_COUNT_HW_CACHE_OP_READ,
+                   PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"l1i_misses", PERF_TYPE_HW_CACHE,
+     PERFCTR_CACHE(PERF_COUNT_HW_CACHE_L1I, PERF_COUNT_HW_CACHE_OP_READ,
+                   PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    // Without a PMU, page_faults leads the group: with task_clock as leader,
+    // the other software events don't count.
+    {"page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {"task_clock_ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {"context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+#define PERFCTR_EVENT_COUNT (sizeof(perfctr_events) / sizeof(perfctr_events[0]))
+
+static const char *const perfctr_phase_names[PERFCTR_PHASE_COUNT] = {
+    [PERFCTR_STARTUP] = "startup",
+    [PERFCTR_PRELOAD] = "preload",
+    [PERFCTR_DISPATCH] = "dispatch",
+    [PERFCTR_RESOLVE] = "resolve",
+};
+
+// Counters that could be opened are members of the group of perfctr_leader,
+// in the order of perfctr_events; others are -1.
+static int perfctr_fds[PERFCTR_EVENT_COUNT];
+static int perfctr_leader = -1;
+static unsigned perfctr_count; // number of open counters, 0 if disabled
+static int perfctr_tid;
+// Whether a counter was not always scheduled and values are estimated.
+static bool perfctr_multiplexed;
+
+static enum PerfctrPhase perfctr_current;
+static uint64_t perfctr_last[PERFCTR_EVENT_COUNT];
+static uint64_t perfctr_totals[PERFCTR_PHASE_COUNT][PERFCTR_EVENT_COUNT];
+static uint64_t perfctr_switches[PERFCTR_PHASE_COUNT];
+
+static void
+perfctr_read(uint64_t values[PERFCTR_EVENT_COUNT])
+{
+    // nr, time_enabled, time_running, one value per group member
+    uint64_t buf[3 + PERFCTR_EVENT_COUNT];
+    size_t size = (3 + perfctr_count) * sizeof(uint64_t);
+    memset(values, 0, PERFCTR_EVENT_COUNT * sizeof(uint64_t));
+    if (read(perfctr_leader, buf, size) != (ssize_t)size)
+        return;
+
+    // The group was multiplexed with other events, scale the values up.
+    double scale = 1;
+    if (buf[2] != buf[1] && buf[2])
+    {
+        perfctr_multiplexed = true;
+        scale = (double)buf[1] / buf[2];
+    }
+    for (unsigned i = 0, member = 0; i < PERFCTR_EVENT_COUNT; i++)
+        if (perfctr_fds[i] >= 0 && member < buf[0])
+            values[i] = scale == 1 ? buf[3 + member++] : (uint64_t)(buf[3 + member++] * scale);
+}
+
+int perfctr_init(void)
+{
+    for (unsigned i = 0; i < PERFCTR_EVENT_COUNT; i++)
+    {
+        struct perf_event_attr attr = {0};
+        attr.size = sizeof(attr);
+        attr.type = perfctr_events[i].type;
+        attr.config = perfctr_events[i].config;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.inherit = 1;
+        // Also works with perf_event_paranoid=2.
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        // The first counter that can be opened leads the group.
+        perfctr_fds[i] = perf_event_open(&attr, 0, -1, perfctr_leader,
+                                         PERF_FLAG_FD_CLOEXEC);
+        if (perfctr_fds[i] < 0)
+            continue;
+        if (perfctr_leader < 0)
+            perfctr_leader = perfctr_fds[i];
+        perfctr_count++;
+    }
+    if (!perfctr_count)
+        return 0;
+
+    perfctr_tid = gettid();
+    perfctr_current = PERFCTR_STARTUP;
+    perfctr_switches[PERFCTR_STARTUP] = 1;
+    perfctr_read(perfctr_last);
+    return perfctr_count;
+}
+
+// Add the counts since the last call to the current phase.
+static void
+perfctr_account(void)
+{
+    uint64_t values[PERFCTR_EVENT_COUNT];
+    perfctr_read(values);
+    for (unsigned i = 0; i < PERFCTR_EVENT_COUNT; i++)
+    {
+        // Scaled estimates are not necessarily monotonic.
+        if (values[i] > perfctr_last[i])
+            perfctr_totals[perfctr_current][i] += values[i] - perfctr_last[i];
+        perfctr_last[i] = values[i];
+    }
+}
+
+enum PerfctrPhase perfctr_phase(struct CpuState *cpu_state, enum PerfctrPhase phase)
+{
+    enum PerfctrPhase prev = perfctr_current;
+    if (!perfctr_count || (cpu_state && cpu_state->tid != perfctr_tid))
+        return prev;
+
+    perfctr_account();
+    perfctr_switches[phase]++;
+    perfctr_current = phase;
+    return prev;
+}
+
+void perfctr_print_stats(int fd)
+{
+    if (!perfctr_count)
+        return;
+
+    if (gettid() == perfctr_tid)
+        perfctr_account();
+
+    for (unsigned p = 0; p < PERFCTR_PHASE_COUNT; p++)
+    {
+        const char *phase = perfctr_phase_names[p];
+        dprintf(fd, "perfctr.%s.entries: %lu\n", phase, perfctr_switches[p]);
+        for (unsigned i = 0; i < PERFCTR_EVENT_COUNT; i++)
+            if (perfctr_fds[i] >= 0)
+                dprintf(fd, "perfctr.%s.%s: %lu\n", phase, perfctr_events[i].name,
+                        perfctr_totals[p][i]);
+    }
+    for (unsigned i = 0; i < PERFCTR_EVENT_COUNT; i++)
+        if (perfctr_fds[i] < 0)
+            dprintf(fd, "perfctr.%s: unavailable\n", perfctr_events[i].name);
+    if (perfctr_multiplexed)
+        dprintf(fd, "perfctr.multiplexed: 1\n");
+}
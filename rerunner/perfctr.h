@@ -0,0 +1,30 @@
+#ifndef _INSTREW_RUNNER_PERFCTR_H
+#define _INSTREW_RUNNER_PERFCTR_H
+
+#include "common.h"
+
+struct CpuState;
+
+// Self-monitoring with perf_event_open. Counters are opened for the initial
+// thread (threads it creates are included once they exit) and attributed to
+// the phase that thread is in. They form one group, so a phase switch costs a
+// single read. Hardware events that can't be opened, e.g. in VMs without a
+// PMU, are skipped; the software events still work there.
+enum PerfctrPhase
+{
+    PERFCTR_STARTUP, // option parsing, ELF loading, rtld setup
+    PERFCTR_PRELOAD,
+    PERFCTR_DISPATCH, // translated code, dispatcher and syscall emulation
+    PERFCTR_RESOLVE,  // inside resolve_func
+    PERFCTR_PHASE_COUNT,
+};
+
+// Returns the number of counters opened; without any, counting is disabled.
+int perfctr_init(void);
+// Switch to a new phase and return the previous one. cpu_state is the calling
+// thread, or NULL for the initial thread before it runs guest code. No-op if
+// disabled or called from another thread.
+enum PerfctrPhase perfctr_phase(struct CpuState *cpu_state, enum PerfctrPhase phase);
+void perfctr_print_stats(int fd);
+
+#endif
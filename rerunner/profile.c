@@ -0,0 +1,176 @@
+#include <linux/mman.h>
+
+#include "common.h"
+#include "memory.h"
+#include "profile.h"
+
+int profile_read(const char *path, struct ProfileEntry **out_entries,
+                 size_t *out_count)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+        return fd;
+
+    struct ProfileHeader hdr;
+    ssize_t ret = read_full(fd, &hdr, sizeof(hdr));
+    if (ret < 0)
+        goto out;
+    ret = -EINVAL;
+    if (memcmp(hdr.magic, PROFILE_MAGIC, sizeof(hdr.magic)) != 0)
+        goto out;
+    if (hdr.count > SIZE_MAX / sizeof(struct ProfileEntry))
+        goto out;
+
+    size_t size = hdr.count * sizeof(struct ProfileEntry);
+    struct ProfileEntry *entries = mem_alloc_data(size, _Alignof(struct ProfileEntry));
+    if (BAD_ADDR(entries))
+    {
+        ret = (intptr_t)entries;
+        goto out;
+    }
+    if (size)
+    {
+        ret = read_full(fd, entries, size);
+        if (ret < 0)
+            goto out;
+    }
+
+    *out_entries = entries;
+    *out_count = hdr.count;
+    ret = 0;
+
+out:
+    close(fd);
+    return ret;
+}
+
+int profile_table_init(struct ProfileTable *table, unsigned bits)
+{
+    size_t size = sizeof(struct ProfileEntry) << bits;
+    struct ProfileEntry *entries = mem_alloc_data(size, getpagesize());
+    if (BAD_ADDR(entries))
+        return (int)(uintptr_t)entries;
+    table->entries = entries;
+    table->mask = (1ul << bits) - 1;
+    table->dropped = 0;
+    return 0;
+}
+
+void profile_table_add(struct ProfileTable *table, uint64_t addr, uint64_t count)
+{
+    if (!addr || !count) // 0 is reserved for "empty"
+        return;
+    size_t hash = addr >> 2;
+    for (size_t i = 0; i < PROFILE_PROBES && i <= table->mask; i++)
+    {
+        struct ProfileEntry *entry = &table->entries[(hash + i) & table->mask];
+        if (entry->addr == addr || !entry->addr)
+        {
+            entry->addr = addr;
+            entry->count += count;
+            return;
+        }
+    }
+    table->dropped += count;
+}
+
+static int
+profile_entry_cmp(const void *a, const void *b)
+{
+    const struct ProfileEntry *ea = a, *eb = b;
+    // Descending count, then ascending address for a stable output.
+    if (ea->count != eb->count)
+        return ea->count > eb->count ? -1 : 1;
+    return ea->addr < eb->addr ? -1 : ea->addr > eb->addr;
+}
+
+size_t profile_table_sort(struct ProfileTable *table)
+{
+    // Compact the table in place; it isn't used afterwards.
+    size_t count = 0;
+    for (size_t i = 0; i <= table->mask; i++)
+        if (table->entries[i].addr)
+            table->entries[count++] = table->entries[i];
+    qsort(table->entries, count, sizeof(struct ProfileEntry), profile_entry_cmp);
+    table->mask = 0;
+    return count;
+}
+
+int profile_table_write(const struct ProfileTable *table, const char *path)
+{
+    // Sort a copy, the table stays usable for flushing while running.
+    size_t size = ALIGN_UP((table->mask + 1) * sizeof(struct ProfileEntry), getpagesize());
+    struct ProfileEntry *entries = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (BAD_ADDR(entries))
+        return (int)(uintptr_t)entries;
+    memcpy(entries, table->entries, (table->mask + 1) * sizeof(struct ProfileEntry));
+    struct ProfileTable sorted = {.entries = entries, .mask = table->mask};
+    size_t count = profile_table_sort(&sorted);
+
+    ssize_t ret = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (ret < 0)
+        goto out;
+    int fd = ret;
+    struct ProfileHeader hdr = {.count = count};
+    memcpy(hdr.magic, PROFILE_MAGIC, sizeof(hdr.magic));
+    ret = write_full(fd, &hdr, sizeof(hdr));
+    if (ret >= 0)
+        ret = write_full(fd, entries, count * sizeof(struct ProfileEntry));
+    close(fd);
+out:
+    munmap(entries, size);
+    return ret < 0 ? ret : 0;
+}
+
+struct ProfileEdgeTable *
+profile_edges_create(unsigned bits)
+{
+    struct ProfileEdgeTable *table = mem_alloc_data(sizeof(*table), _Alignof(struct ProfileEdgeTable));
+    if (BAD_ADDR(table))
+        return table;
+    // Not from the data arena, which can be used up by loaded objects by the
+    // time the merged table is created at exit.
+    struct ProfileEdge *edges = mmap(NULL, sizeof(struct ProfileEdge) << bits,
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (BAD_ADDR(edges))
+        return (void *)edges;
+    table->edges = edges;
+    table->mask = (1ul << bits) - 1;
+    table->dropped = 0;
+    table->next = NULL;
+    return table;
+}
+
+static int
+profile_edge_cmp(const void *a, const void *b)
+{
+    const struct ProfileEdge *ea = a, *eb = b;
+    if (ea->count != eb->count)
+        return ea->count > eb->count ? -1 : 1;
+    if (ea->from != eb->from)
+        return ea->from < eb->from ? -1 : 1;
+    return ea->to < eb->to ? -1 : ea->to > eb->to;
+}
+
+int profile_edges_write(struct ProfileEdgeTable *table, const char *path)
+{
+    // Compact the table in place; it isn't used afterwards.
+    size_t count = 0;
+    for (size_t i = 0; i <= table->mask; i++)
+        if (table->edges[i].count)
+            table->edges[count++] = table->edges[i];
+    qsort(table->edges, count, sizeof(struct ProfileEdge), profile_edge_cmp);
+    table->mask = 0;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return fd;
+    dprintf(fd, "# caller callee count\n");
+    for (size_t i = 0; i < count; i++)
+        dprintf(fd, "%lx %lx %lu\n", table->edges[i].from, table->edges[i].to,
+                table->edges[i].count);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,98 @@
+#ifndef _INSTREW_RUNNER_PROFILE_H
+#define _INSTREW_RUNNER_PROFILE_H
+
+#include "common.h"
+
+// Execution profile of guest functions, stored as "profile" in the cache
+// directory. The file consists of a header followed by the entries, sorted by
+// descending count. All values are in host byte order.
+#define PROFILE_MAGIC "INSTPRF1"
+#define PROFILE_FILE_NAME "profile"
+
+struct ProfileHeader
+{
+    char magic[8];
+    uint64_t count;
+};
+
+struct ProfileEntry
+{
+    uint64_t addr;
+    uint64_t count;
+};
+
+// Read a profile into newly allocated memory.
+int profile_read(const char *path, struct ProfileEntry **out_entries,
+                 size_t *out_count);
+
+// Tables don't grow. An entry that finds no free slot within this many probes
+// is counted as dropped, so that a crowded table doesn't stall the caller.
+#define PROFILE_PROBES 32
+
+// Hash table accumulating counts per guest address while profiling.
+struct ProfileTable
+{
+    struct ProfileEntry *entries;
+    size_t mask;
+    // Counts that didn't fit into the table.
+    uint64_t dropped;
+};
+
+int profile_table_init(struct ProfileTable *table, unsigned bits);
+void profile_table_add(struct ProfileTable *table, uint64_t addr, uint64_t count);
+// Sort the entries by descending count into the start of table->entries and
+// return their number. The table can't be used for adding entries afterwards.
+size_t profile_table_sort(struct ProfileTable *table);
+// Write all entries of the table, sorted by descending count. The table is
+// not modified.
+int profile_table_write(const struct ProfileTable *table, const char *path);
+
+// Call graph edges, (call site or caller, callee) pairs with a count. Tables
+// are owned by one thread each and only merged at exit, so no locking or
+// atomic operations are needed when recording.
+#define PROFILE_CALLGRAPH_FILE_NAME "callgraph"
+
+struct ProfileEdge
+{
+    uint64_t from;
+    uint64_t to;
+    uint64_t count;
+};
+
+struct ProfileEdgeTable
+{
+    struct ProfileEdge *edges;
+    size_t mask;
+    uint64_t dropped;
+    // Next table of the process, for merging.
+    struct ProfileEdgeTable *next;
+};
+
+struct ProfileEdgeTable *profile_edges_create(unsigned bits);
+
+static inline void
+profile_edges_add(struct ProfileEdgeTable *table, uint64_t from, uint64_t to,
+                  uint64_t count)
+{
+    size_t hash = (from >> 2) ^ (to >> 2) * 0x9e3779b1;
+    for (size_t i = 0; i < PROFILE_PROBES; i++)
+    {
+        struct ProfileEdge *edge = &table->edges[(hash + i) & table->mask];
+        if (edge->from == from && edge->to == to)
+        {
+            edge->count += count;
+            return;
+        }
+        if (!edge->count)
+        {
+            *edge = (struct ProfileEdge){from, to, count};
+            return;
+        }
+    }
+    table->dropped += count;
+}
+
+// Write the edges of the table as text, sorted by descending count.
+int profile_edges_write(struct ProfileEdgeTable *table, const char *path);
+
+#endif
@@ -0,0 +1,489 @@
+#include <asm/stat.h>
+#include <asm/statfs.h>
+#include <asm/termios.h>
+#include <linux/mman.h>
+#include <linux/sysinfo.h>
+#include <linux/uio.h>
+#include <linux/utsname.h>
+
+#include "common.h"
+#include "replay.h"
+#include "stats.h"
+
+#define REPLAY_MAGIC "INSTREWR"
+#define REPLAY_VERSION 1
+#define REPLAY_BUFFER_SIZE 0x40000
+
+struct ReplayHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t _pad;
+};
+
+// Followed by data_size bytes of output data, padded to 8 bytes.
+struct ReplayRecord
+{
+    uint64_t nr;
+    uint64_t args[6];
+    int64_t res;
+    uint64_t data_size;
+};
+
+enum ReplayMode replay_mode;
+
+// Record: buffered output to fd. Replay: the mapped log.
+static int replay_fd = -1;
+static uint8_t *replay_buf;
+static size_t replay_buf_used;
+static const uint8_t *replay_pos;
+static const uint8_t *replay_end;
+static uint64_t replay_count;
+
+static int
+replay_flush(void)
+{
+    ssize_t ret = write_full(replay_fd, replay_buf, replay_buf_used);
+    replay_buf_used = 0;
+    return ret < 0 ? ret : 0;
+}
+
+static void
+replay_append(const void *data, size_t size)
+{
+    if (replay_buf_used + size > REPLAY_BUFFER_SIZE)
+    {
+        replay_flush();
+        if (size > REPLAY_BUFFER_SIZE)
+        {
+            write_full(replay_fd, data, size);
+            return;
+        }
+    }
+    memcpy(replay_buf + replay_buf_used, data, size);
+    replay_buf_used += size;
+}
+
+// Append size bytes of the file at offset, as mapped by a guest mmap.
+static void
+replay_append_file(int fd, uint64_t offset, size_t size)
+{
+    while (size)
+    {
+        if (replay_buf_used == REPLAY_BUFFER_SIZE)
+            replay_flush();
+        size_t chunk = REPLAY_BUFFER_SIZE - replay_buf_used;
+        if (chunk > size)
+            chunk = size;
+        ssize_t ret = syscall(__NR_pread64, fd, (uintptr_t)replay_buf + replay_buf_used,
+                              chunk, offset, 0, 0);
+        if (ret <= 0) // file shrunk, keep the record size consistent
+        {
+            memset(replay_buf + replay_buf_used, 0, chunk);
+            ret = chunk;
+        }
+        replay_buf_used += ret;
+        offset += ret;
+        size -= ret;
+    }
+}
+
+int replay_init(enum ReplayMode mode, const char *path)
+{
+    if (mode == REPLAY_RECORD)
+    {
+        replay_buf = mmap(NULL, REPLAY_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (BAD_ADDR(replay_buf))
+            return (int)(uintptr_t)replay_buf;
+        replay_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (replay_fd < 0)
+            return replay_fd;
+        struct ReplayHeader hdr = {REPLAY_MAGIC, REPLAY_VERSION, 0};
+        replay_append(&hdr, sizeof(hdr));
+    }
+    else if (mode == REPLAY_REPLAY)
+    {
+        int fd = open(path, O_RDONLY | O_CLOEXEC, 0);
+        if (fd < 0)
+            return fd;
+        struct stat st;
+        int ret = syscall(__NR_fstat, fd, (uintptr_t)&st, 0, 0, 0, 0);
+        if (ret < 0)
+        {
+            close(fd);
+            return ret;
+        }
+        const struct ReplayHeader *hdr = NULL;
+        if (st.st_size >= (long)sizeof(*hdr))
+            hdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (!hdr)
+            return -EINVAL;
+        if (BAD_ADDR(hdr))
+            return (int)(uintptr_t)hdr;
+        if (memcmp(hdr->magic, REPLAY_MAGIC, sizeof(hdr->magic)) ||
+            hdr->version != REPLAY_VERSION)
+            return -EINVAL;
+        replay_pos = (const uint8_t *)(hdr + 1);
+        replay_end = (const uint8_t *)hdr + st.st_size;
+    }
+    replay_mode = mode;
+    return 0;
+}
+
+// Syscalls that are executed in replay mode as well. Their results, e.g.
+// addresses, are not taken from the log.
+static bool
+replay_is_native(uint64_t nr)
+{
+    switch (nr)
+    {
+    case __NR_mmap:
+    case __NR_munmap:
+    case __NR_mprotect:
+    case __NR_mremap:
+    case __NR_madvise:
+    case __NR_brk:
+    case __NR_futex:
+    case __NR_set_tid_address:
+    case __NR_set_robust_list:
+    case __NR_get_robust_list:
+    case __NR_sched_yield:
+    case __NR_tgkill:
+    case __NR_exit:
+    case __NR_exit_group:
+        return true;
+    default:
+        return false;
+    }
+}
+
+typedef void (*ReplayOutputFn)(void *ctx, void *ptr, size_t size);
+
+// Call fn for every range of guest memory the syscall wrote its output to.
+// Returns false if the outputs of the syscall are unknown, so that it cannot be
+// replayed; every syscall forwarded by emulate.c must be listed here.
+static bool
+replay_for_each_output(uint64_t nr, const uint64_t *args, int64_t res,
+                       ReplayOutputFn fn, void *ctx)
+{
+#define OUTPUT(ptr, size)                            \
+    do                                               \
+    {                                                \
+        if ((ptr) && (size) != 0)                    \
+            fn(ctx, (void *)(uintptr_t)(ptr), size); \
+    } while (0)
+
+    if (res < 0)
+        return true;
+    switch (nr)
+    {
+    case __NR_read:
+    case __NR_pread64:
+    case __NR_getdents64:
+        OUTPUT(args[1], res);
+        break;
+    case __NR_readv:
+    case __NR_preadv:
+    {
+        const struct iovec *iov = (const struct iovec *)args[1];
+        size_t left = res;
+        for (size_t i = 0; i < args[2] && left; i++)
+        {
+            size_t size = iov[i].iov_len < left ? iov[i].iov_len : left;
+            OUTPUT(iov[i].iov_base, size);
+            left -= size;
+        }
+        break;
+    }
+    case __NR_fstat:
+        OUTPUT(args[1], sizeof(struct stat));
+        break;
+    case __NR_newfstatat:
+        OUTPUT(args[2], sizeof(struct stat));
+        break;
+    case __NR_readlinkat:
+        OUTPUT(args[2], res);
+        break;
+    case __NR_getcwd:
+    case __NR_getrandom:
+        OUTPUT(args[0], res);
+        break;
+    case __NR_getxattr:
+    case __NR_lgetxattr:
+    case __NR_fgetxattr:
+        if (args[3])
+            OUTPUT(args[2], res);
+        break;
+    case __NR_clock_gettime:
+    case __NR_clock_getres:
+        OUTPUT(args[1], sizeof(struct timespec));
+        break;
+    case __NR_gettimeofday:
+        OUTPUT(args[0], sizeof(struct timeval));
+        OUTPUT(args[1], sizeof(struct timezone));
+        break;
+    case __NR_uname:
+        OUTPUT(args[0], sizeof(struct new_utsname));
+        break;
+    case __NR_sysinfo:
+        OUTPUT(args[0], sizeof(struct sysinfo));
+        break;
+    case __NR_getrlimit:
+        OUTPUT(args[1], sizeof(struct rlimit));
+        break;
+    case __NR_prlimit64:
+        OUTPUT(args[3], sizeof(struct rlimit64));
+        break;
+    case __NR_getgroups:
+        if (args[0])
+            OUTPUT(args[1], res * sizeof(__kernel_gid_t));
+        break;
+    case __NR_pipe2:
+        OUTPUT(args[0], 2 * sizeof(int));
+        break;
+    case __NR_ppoll:
+        OUTPUT(args[0], args[1] * 8); // struct pollfd
+        break;
+#ifdef __NR_select
+    case __NR_select:
+#endif
+    case __NR_pselect6:
+        for (size_t i = 1; i <= 3; i++)
+            OUTPUT(args[i], (args[0] + 63) / 64 * 8); // fd_set
+        break;
+    case __NR_rt_sigpending:
+        OUTPUT(args[0], args[1]);
+        break;
+    case __NR_wait4:
+        OUTPUT(args[1], sizeof(int));
+        OUTPUT(args[3], sizeof(struct rusage));
+        break;
+    case __NR_statfs:
+        OUTPUT(args[1], sizeof(struct statfs));
+        break;
+    case __NR_fcntl:
+        if (args[1] == F_GETLK)
+            OUTPUT(args[2], sizeof(struct flock));
+        break;
+    case __NR_ioctl:
+        switch (args[1])
+        {
+        case TCGETS:
+            OUTPUT(args[2], sizeof(struct termios));
+            break;
+        case TIOCGWINSZ:
+            OUTPUT(args[2], sizeof(struct winsize));
+            break;
+        case FIONREAD:
+            OUTPUT(args[2], sizeof(int));
+            break;
+        case TCSETS:
+        case TCSETSW:
+        case TCSETSF:
+        case TIOCSWINSZ:
+        case FIOCLEX:
+        case FIONCLEX:
+            break;
+        default:
+            return false;
+        }
+        break;
+
+    // Only a result. clock_nanosleep writes the remaining time only when it
+    // fails with EINTR.
+    case __NR_write:
+    case __NR_pwrite64:
+    case __NR_writev:
+    case __NR_openat:
+    case __NR_close:
+    case __NR_lseek:
+    case __NR_dup:
+    case __NR_dup3:
+    case __NR_socket:
+    case __NR_connect:
+    case __NR_truncate:
+    case __NR_ftruncate:
+    case __NR_chdir:
+    case __NR_fchdir:
+    case __NR_chroot:
+    case __NR_fchmod:
+    case __NR_fchmodat:
+    case __NR_fchown:
+    case __NR_fchownat:
+    case __NR_mkdirat:
+    case __NR_unlinkat:
+    case __NR_renameat:
+    case __NR_renameat2:
+    case __NR_faccessat:
+    case __NR_fadvise64:
+    case __NR_clock_nanosleep:
+    case __NR_rt_sigsuspend:
+    case __NR_getpid:
+    case __NR_getppid:
+    case __NR_gettid:
+    case __NR_getuid:
+    case __NR_getgid:
+    case __NR_geteuid:
+    case __NR_getegid:
+    case __NR_setgroups:
+        break;
+    default:
+        return false;
+    }
+    return true;
+#undef OUTPUT
+}
+
+static void
+replay_output_size(void *ctx, void *ptr, size_t size)
+{
+    (void)ptr;
+    *(uint64_t *)ctx += size;
+}
+
+static void
+replay_output_record(void *ctx, void *ptr, size_t size)
+{
+    (void)ctx;
+    replay_append(ptr, size);
+}
+
+static void
+replay_output_replay(void *ctx, void *ptr, size_t size)
+{
+    const uint8_t **data = ctx;
+    memcpy(ptr, *data, size);
+    *data += size;
+}
+
+// Bytes of a file mapping that are backed by the file.
+static size_t
+replay_mmap_file_size(const uint64_t *args, int64_t res)
+{
+    if (BAD_ADDR(res) || (args[3] & MAP_ANONYMOUS) || (int)args[4] < 0)
+        return 0;
+    struct stat st;
+    if (syscall(__NR_fstat, args[4], (uintptr_t)&st, 0, 0, 0, 0) < 0 ||
+        (uint64_t)st.st_size <= args[5])
+        return 0;
+    uint64_t size = st.st_size - args[5];
+    return size < args[1] ? size : args[1];
+}
+
+static void
+replay_record(uint64_t nr, const uint64_t *args, int64_t res)
+{
+    struct ReplayRecord rec = {.nr = nr, .res = res};
+    memcpy(rec.args, args, sizeof(rec.args));
+    size_t file_size = 0;
+    if (nr == __NR_mmap)
+        rec.data_size = file_size = replay_mmap_file_size(args, res);
+    else if (!replay_is_native(nr) &&
+             !replay_for_each_output(nr, args, res, replay_output_size, &rec.data_size))
+    {
+        // Still logged, replaying stops when it gets here.
+        static bool warned;
+        if (!warned)
+            dprintf(2, "warning: syscall %lu (%lx) cannot be replayed\n", nr, args[1]);
+        warned = true;
+    }
+
+    replay_append(&rec, sizeof(rec));
+    if (file_size)
+        replay_append_file(args[4], args[5], file_size);
+    else
+        replay_for_each_output(nr, args, res, replay_output_record, NULL);
+    static const uint64_t zero;
+    replay_append(&zero, -rec.data_size & 7);
+    replay_count++;
+}
+
+static _Noreturn void
+replay_diverged(uint64_t nr, const struct ReplayRecord *rec)
+{
+    if (rec)
+        dprintf(2, "error: replay diverged at syscall %lu: expected %lu, got %lu\n",
+                replay_count, rec->nr, nr);
+    else
+        dprintf(2, "error: replay log ended at syscall %lu (%lu)\n", replay_count, nr);
+    stats_print_fatal();
+    _exit(1);
+}
+
+static _Noreturn void
+replay_unknown(uint64_t nr, const uint64_t *args)
+{
+    dprintf(2, "error: cannot replay syscall %lu (%lu): unknown outputs (%lx)\n",
+            replay_count - 1, nr, args[1]);
+    stats_print_fatal();
+    _exit(1);
+}
+
+// Replay a file mapping as anonymous mapping with the logged contents.
+static int64_t
+replay_mmap(const uint64_t *args, const uint8_t *data, size_t size)
+{
+    if ((args[3] & MAP_ANONYMOUS) || (int)args[4] < 0)
+        return syscall(__NR_mmap, args[0], args[1], args[2], args[3], args[4], args[5]);
+    uint64_t flags = (args[3] & ~(uint64_t)MAP_TYPE) | MAP_PRIVATE | MAP_ANONYMOUS;
+    int64_t res = syscall(__NR_mmap, args[0], args[1], args[2] | PROT_WRITE, flags, -1, 0);
+    if (BAD_ADDR(res))
+        return res;
+    memcpy((void *)res, data, size);
+    if (!(args[2] & PROT_WRITE))
+        syscall(__NR_mprotect, res, args[1], args[2], 0, 0, 0);
+    return res;
+}
+
+static int64_t
+replay_replay(uint64_t nr, const uint64_t *args)
+{
+    const struct ReplayRecord *rec = (const struct ReplayRecord *)replay_pos;
+    if (replay_end - replay_pos < (ptrdiff_t)sizeof(*rec))
+        replay_diverged(nr, NULL);
+    if (rec->nr != nr)
+        replay_diverged(nr, rec);
+    const uint8_t *data = (const uint8_t *)(rec + 1);
+    if ((uint64_t)(replay_end - data) < rec->data_size)
+        replay_diverged(nr, NULL);
+    replay_pos = data + ALIGN_UP(rec->data_size, 8);
+    replay_count++;
+
+    if (nr == __NR_mmap)
+        return replay_mmap(args, data, rec->data_size);
+    if (replay_is_native(nr))
+        return syscall(nr, args[0], args[1], args[2], args[3], args[4], args[5]);
+
+    // The output ranges are computed from the current arguments, so they
+    // have to add up to the logged data.
+    uint64_t size = 0;
+    if (!replay_for_each_output(nr, args, rec->res, replay_output_size, &size))
+        replay_unknown(nr, args);
+    if (size != rec->data_size)
+        replay_diverged(nr, rec);
+    replay_for_each_output(nr, args, rec->res, replay_output_replay, &data);
+    return rec->res;
+}
+
+long replay_syscall(uint64_t nr, uint64_t arg0, uint64_t arg1, uint64_t arg2,
+                    uint64_t arg3, uint64_t arg4, uint64_t arg5)
+{
+    const uint64_t args[6] = {arg0, arg1, arg2, arg3, arg4, arg5};
+    if (replay_mode == REPLAY_REPLAY)
+        return replay_replay(nr, args);
+
+    // These don't return, so log them up front.
+    if (nr == __NR_exit || nr == __NR_exit_group)
+    {
+        replay_record(nr, args, 0);
+        if (replay_flush() < 0)
+            dprintf(2, "warning: could not write syscall log\n");
+    }
+
+    long res = syscall(nr, arg0, arg1, arg2, arg3, arg4, arg5);
+    if (nr != __NR_exit && nr != __NR_exit_group)
+        replay_record(nr, args, res);
+    return res;
+}
@@ -0,0 +1,29 @@
+#ifndef _INSTREW_RUNNER_REPLAY_H
+#define _INSTREW_RUNNER_REPLAY_H
+
+#include "common.h"
+
+// Syscall record and replay: with -record, every host syscall issued on
+// behalf of the guest is logged with its arguments, result and the data the
+// kernel wrote into guest memory. With -replay, results and data are served
+// from the log instead, so the guest runs without touching files or clocks.
+// Memory management and thread syscalls are still executed natively, file
+// mappings are replayed as anonymous mappings filled from the log. Replay is
+// deterministic for single-threaded guests that don't depend on signals.
+#define REPLAY_FILE_NAME "syscalls.rec"
+
+enum ReplayMode
+{
+    REPLAY_OFF,
+    REPLAY_RECORD,
+    REPLAY_REPLAY,
+};
+
+extern enum ReplayMode replay_mode;
+
+int replay_init(enum ReplayMode mode, const char *path);
+// Issue, record or replay a host syscall, depending on replay_mode.
+long replay_syscall(uint64_t nr, uint64_t arg0, uint64_t arg1, uint64_t arg2,
+                    uint64_t arg3, uint64_t arg4, uint64_t arg5);
+
+#endif
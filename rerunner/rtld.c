@@ -8,6 +8,8 @@
 #include "common.h"
 #include "memory.h"
 #include "rtld.h"
+#include "stats.h"
+#include "symbols.h"
 
 // Old elf.h don't include unwind sections
 #if !defined(SHT_X86_64_UNWIND)
@@ -60,7 +62,6 @@ rtld_blend(void *tgt, uint64_t mask, uint64_t data)
         *(uint8_t *)tgt = (data & mask) | (*(uint8_t *)tgt & ~mask);
 }
 
-#define RTLD_HASH_BITS 17
 #define RTLD_HASH_MASK ((1 << RTLD_HASH_BITS) - 1)
 #define RTLD_HASH(addr) (((addr >> 2)) & RTLD_HASH_MASK)
 
@@ -79,6 +80,8 @@ struct PltEntry
 static const struct PltEntry plt_entries[] = {
     {"instrew_quick_dispatch", 0}, // dynamically set below
     {"instrew_full_dispatch", 0},  // dynamically set below
+    {"instrew_tail_cdecl", 0},     // dynamically set below
+    {"instrew_call_cdecl", 0},     // dynamically set below
 #define PLT_ENTRY(name, func) {name, (uintptr_t) & (PASTE(rtld_plt_, func))},
 #include "plt.inc"
 #undef PLT_ENTRY
@@ -111,7 +114,7 @@ plt_create(const struct DispatcherInfo *disp_info, void **out_plt)
 
         if (i == 0)
             *data_ptr = disp_info->quick_dispatch_func;
-        else if (i == 1)
+        else if (i <= 3) // full dispatch, cdecl tail and call
             *data_ptr = disp_info->full_dispatch_func;
         else
             *data_ptr = plt_entries[i].func;
@@ -132,6 +135,7 @@ plt_create(const struct DispatcherInfo *disp_info, void **out_plt)
     int ret = mem_write_code(pltcode, plt, sizeof(plt));
     if (ret < 0)
         return ret;
+    mem_flush_code();
     *out_plt = pltcode;
 
     return 0;
@@ -145,7 +149,7 @@ rtld_patch_create_stub(Rtld *rtld, const struct RtldPatchData *patch_data,
                    "patch data alignment too big");
     _Alignas(0x10) uint8_t stcode[0x10 + sizeof(*patch_data)];
 
-    void *stub = mem_alloc_code(sizeof(stcode), 0x40);
+    void *stub = mem_alloc_stub(sizeof(stcode), 0x10);
     if (BAD_ADDR(stub))
         return (int)(uintptr_t)stub;
 
@@ -177,6 +181,7 @@ rtld_patch_create_stub(Rtld *rtld, const struct RtldPatchData *patch_data,
     if (ret < 0)
         return ret;
 
+    rtld->stats.stubs++;
     *out_stub = (uintptr_t)stub;
     return 0;
 }
@@ -267,6 +272,193 @@ rtld_elf_resolve_str(RtldElf *re, size_t strtab_idx, size_t str_idx, const char
     return 0;
 }
 
+// Entries of SHF_MERGE sections (constants, strings) are interned globally, so
+// that every distinct constant exists only once in the rodata arena. Sections
+// are only considered for merging if nothing relocates their contents and
+// their entries are well-formed; these get no per-object allocation and keep
+// sh_addr == 0 until a reference can't be mapped to a single entry.
+#define RTLD_MERGE_BITS 14 // initial size
+// The table is rehashed into one of twice the size when it is half full, so
+// long probe sequences are rare. An entry that still finds no free slot
+// nearby, or if the table can't grow, is copied privately.
+#define RTLD_MERGE_PROBES 32
+
+struct RtldMergeEntry
+{
+    uint64_t hash;
+    uint32_t size;
+    uint32_t entsize;
+    const void *data;
+};
+
+static uint64_t
+rtld_merge_hash(const uint8_t *data, size_t size, size_t entsize)
+{
+    uint64_t hash = 0xcbf29ce484222325 ^ entsize; // FNV-1a
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ data[i]) * 0x100000001b3;
+    // The low bits select the slot, fold the better mixed high bits in.
+    return hash ^ (hash >> 32);
+}
+
+static bool
+rtld_merge_candidate(RtldElf *re, unsigned shidx)
+{
+    Elf64_Shdr *shdr = re->re_shdr + shidx;
+    if ((shdr->sh_flags & (SHF_ALLOC | SHF_MERGE | SHF_EXECINSTR)) != (SHF_ALLOC | SHF_MERGE))
+        return false;
+    if (shdr->sh_type != SHT_PROGBITS || shdr->sh_size == 0)
+        return false;
+    if (shdr->sh_flags & SHF_STRINGS)
+    {
+        const uint8_t *data = re->base + shdr->sh_offset;
+        if (shdr->sh_entsize != 1 || data[shdr->sh_size - 1] != 0)
+            return false;
+    }
+    else if (shdr->sh_entsize == 0 || shdr->sh_size % shdr->sh_entsize)
+    {
+        return false;
+    }
+
+    // Contents that are relocated can't be compared by value.
+    Elf64_Shdr *elf_shnt = re->re_shdr;
+    for (int i = 0; i < re->re_ehdr->e_shnum; i++, elf_shnt++)
+        if (elf_shnt->sh_type == SHT_RELA && elf_shnt->sh_info == shidx)
+            return false;
+    return true;
+}
+
+static RtldMergeEntry *
+rtld_merge_alloc(size_t count)
+{
+    // Not from the data arena, the table is freed when it grows. Only pages
+    // in use are committed.
+    return mmap(NULL, count * sizeof(RtldMergeEntry), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+}
+
+static void
+rtld_merge_grow(Rtld *r)
+{
+    size_t mask = 2 * r->merge_mask + 1;
+    RtldMergeEntry *merge = rtld_merge_alloc(mask + 1);
+    if (BAD_ADDR(merge))
+        return; // keep the old table
+    for (size_t i = 0; i <= r->merge_mask; i++)
+    {
+        const RtldMergeEntry *old = &r->merge[i];
+        if (!old->data)
+            continue;
+        size_t j = old->hash & mask;
+        while (merge[j].data)
+            j = (j + 1) & mask;
+        merge[j] = *old;
+    }
+    munmap(r->merge, (r->merge_mask + 1) * sizeof(RtldMergeEntry));
+    r->merge = merge;
+    r->merge_mask = mask;
+}
+
+// Return the canonical copy of the entry at [data, data+size).
+static const void *
+rtld_merge_intern(Rtld *r, const uint8_t *data, size_t size, size_t entsize,
+                  size_t align)
+{
+    if (r->stats.merge_entries >= (r->merge_mask + 1) / 2)
+        rtld_merge_grow(r);
+
+    uint64_t hash = rtld_merge_hash(data, size, entsize);
+    RtldMergeEntry *entry = NULL;
+    for (size_t i = 0; i < RTLD_MERGE_PROBES; i++)
+    {
+        RtldMergeEntry *cur = &r->merge[(hash + i) & r->merge_mask];
+        if (!cur->data)
+        {
+            entry = cur;
+            break;
+        }
+        if (cur->hash == hash && cur->size == size && cur->entsize == entsize &&
+            !memcmp(cur->data, data, size) &&
+            ((uintptr_t)cur->data & (align - 1)) == 0)
+        {
+            r->stats.merge_hits++;
+            return cur->data;
+        }
+    }
+
+    void *copy = mem_alloc_rodata(size, align);
+    if (BAD_ADDR(copy))
+        return copy;
+    int ret = mem_write_rodata(copy, data, size);
+    if (ret < 0)
+        return (void *)(intptr_t)ret;
+    if (entry)
+    {
+        *entry = (RtldMergeEntry){hash, size, entsize, copy};
+        r->stats.merge_entries++;
+    }
+    else
+    {
+        r->stats.merge_unshared++;
+    }
+    return copy;
+}
+
+// Resolve offset off into merge section shidx.
+static int
+rtld_merge_resolve(RtldElf *re, unsigned shidx, int64_t off, uintptr_t *out_addr)
+{
+    Elf64_Shdr *shdr = re->re_shdr + shidx;
+    const uint8_t *data = re->base + shdr->sh_offset;
+    size_t align = shdr->sh_addralign ? shdr->sh_addralign : 1;
+
+    if (!shdr->sh_addr && off >= 0 && (uint64_t)off < shdr->sh_size)
+    {
+        size_t start, end;
+        if (shdr->sh_flags & SHF_STRINGS)
+        {
+            for (start = off; start > 0 && data[start - 1]; start--)
+                ;
+            for (end = off; data[end]; end++)
+                ;
+            end++; // include NUL terminator
+            // Keep the alignment the string had within the section.
+            if (start & (align - 1))
+                align = start & -start;
+        }
+        else
+        {
+            start = off - off % shdr->sh_entsize;
+            end = start + shdr->sh_entsize;
+            if (align > shdr->sh_entsize)
+                align = shdr->sh_entsize & -shdr->sh_entsize;
+        }
+
+        const void *canon = rtld_merge_intern(re->rtld, data + start,
+                                              end - start, shdr->sh_entsize,
+                                              align);
+        if (BAD_ADDR(canon))
+            return (int)(uintptr_t)canon;
+        *out_addr = (uintptr_t)canon + (off - start);
+        return 0;
+    }
+
+    // The reference doesn't point into a single entry, so the section has to
+    // exist as a whole. Merge sections have no relocations, so copy it now.
+    if (!shdr->sh_addr)
+    {
+        void *copy = mem_alloc_rodata(shdr->sh_size, align);
+        if (BAD_ADDR(copy))
+            return (int)(uintptr_t)copy;
+        int ret = mem_write_rodata(copy, data, shdr->sh_size);
+        if (ret < 0)
+            return ret;
+        shdr->sh_addr = (uintptr_t)copy;
+    }
+    *out_addr = shdr->sh_addr + off;
+    return 0;
+}
+
 static int
 rtld_elf_resolve_sym(RtldElf *re, size_t symtab_idx, size_t sym_idx,
                      struct RtldPatchData *patch_data, uintptr_t *out_addr)
@@ -301,7 +493,8 @@ rtld_elf_resolve_sym(RtldElf *re, size_t symtab_idx, size_t sym_idx,
             uintptr_t addr = 0;
             if (!rtld_elf_decode_name(re, name, &addr))
             {
-                if (!rtld_resolve(re->rtld, addr, (void **)out_addr))
+                if (!re->rtld->disp_info->counting &&
+                    !rtld_resolve(re->rtld, addr, (void **)out_addr))
                     return 0; // we got it already
                 // Create a stub. We cannot use the normal dispatcher, as the
                 // target address is not necessarily set.
@@ -330,6 +523,18 @@ rtld_elf_resolve_sym(RtldElf *re, size_t symtab_idx, size_t sym_idx,
     else if (sym->st_shndx < re->re_ehdr->e_shnum)
     {
         Elf64_Shdr *tgt_shdr = re->re_shdr + sym->st_shndx;
+        if (tgt_shdr->sh_flags & SHF_MERGE)
+        {
+            // For section symbols, the addend selects the entry; otherwise,
+            // the symbol does and the addend is applied to the result.
+            if (ELF64_ST_TYPE(sym->st_info) != STT_SECTION)
+                return rtld_merge_resolve(re, sym->st_shndx, sym->st_value, out_addr);
+            int64_t off = sym->st_value + patch_data->addend;
+            int ret = rtld_merge_resolve(re, sym->st_shndx, off, out_addr);
+            if (ret == 0)
+                patch_data->addend = 0;
+            return ret;
+        }
         *out_addr = tgt_shdr->sh_addr + sym->st_value;
     }
     else
@@ -352,7 +557,7 @@ rtld_elf_add_stub(uintptr_t sym, uintptr_t *out_stub)
         0xd61f0200,                                 // br x16
     };
 
-    void *stub = mem_alloc_code(sizeof(stcode), 0x40);
+    void *stub = mem_alloc_code(sizeof(stcode), sizeof(uint32_t));
     if (BAD_ADDR(stub))
         return (int)(uintptr_t)stub;
     int ret = mem_write_code(stub, stcode, sizeof(stcode));
@@ -414,7 +619,6 @@ rtld_reloc_at(const struct RtldPatchData *patch_data, void *tgt, void *sym)
         if (!CHECK_SIGNED_BITS(prel_syma, 28))
         {
             // Ok, let's create a stub.
-            // TODO: make stubs more compact/efficient
             uintptr_t stub = 0;
             int ret = rtld_elf_add_stub(syma, &stub);
             if (ret < 0)
@@ -523,7 +727,7 @@ rtld_elf_process_rela(RtldElf *re, int rela_idx)
 }
 
 static int rtld_set(Rtld *r, uintptr_t addr, void *entry, void *obj_base,
-                    size_t obj_size)
+                    size_t obj_size, RtldObject **out_obj)
 {
     // Note: not thread-safe. We first find a spot, then populate the data, and
     // then write the address, so that concurrent readers only ever see valid
@@ -545,6 +749,7 @@ static int rtld_set(Rtld *r, uintptr_t addr, void *entry, void *obj_base,
             obj->base = obj_base;
             obj->size = obj_size;
             atomic_store_explicit(&obj->addr, addr, memory_order_release);
+            *out_obj = obj;
             return 0;
         }
     }
@@ -586,9 +791,125 @@ struct RtldPerfJitRecordCodeLoad
     uint64_t code_index;
 };
 
-int rtld_add_object(Rtld *r, void *obj_base, size_t obj_size, uint64_t skew)
+#define RTLD_PERF_JIT_MAGIC 0x4A695444
+#define RTLD_PERF_JIT_VERSION 1
+#define RTLD_PERF_JIT_CODE_LOAD 0
+
+static uint64_t
+rtld_perf_timestamp(void)
+{
+    // perf record must use the same clock, i.e. -k mono.
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int rtld_perf_init(Rtld *r, bool map, bool jitdump)
+{
+    char path[64];
+    if (map)
+    {
+        snprintf(path, sizeof(path), "/tmp/perf-%u.map", getpid());
+        r->perf_map_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (r->perf_map_fd < 0)
+            return r->perf_map_fd;
+    }
+    if (jitdump)
+    {
+        snprintf(path, sizeof(path), "/tmp/jit-%u.dump", getpid());
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return fd;
+
+        struct RtldPerfJitHeader hdr = {
+            .magic = RTLD_PERF_JIT_MAGIC,
+            .version = RTLD_PERF_JIT_VERSION,
+            .total_size = sizeof(hdr),
+            .elf_mach = EM_CURRENT,
+            .pid = getpid(),
+            .timestamp = rtld_perf_timestamp(),
+        };
+        ssize_t ret = write_full(fd, &hdr, sizeof(hdr));
+        if (ret < 0)
+        {
+            close(fd);
+            return ret;
+        }
+
+        // perf inject finds the dump file through this executable mapping,
+        // which is therefore kept until exit.
+        void *marker = mmap(NULL, getpagesize(), PROT_READ | PROT_EXEC,
+                            MAP_PRIVATE, fd, 0);
+        if (BAD_ADDR(marker))
+        {
+            close(fd);
+            return (int)(uintptr_t)marker;
+        }
+        r->perf_dump_fd = fd;
+    }
+    return 0;
+}
+
+static void
+rtld_perf_notify(Rtld *r, uintptr_t addr, void *entry, size_t size)
+{
+    char name[256];
+    if (symbols_format(addr, name, sizeof(name)) < 0)
+        snprintf(name, sizeof(name), "guest_%lx", addr);
+
+    if (r->perf_map_fd >= 0)
+        dprintf(r->perf_map_fd, "%lx %lx %s\n", (uintptr_t)entry, size, name);
+    if (r->perf_dump_fd >= 0)
+    {
+        size_t name_size = strlen(name) + 1;
+        struct RtldPerfJitRecordCodeLoad rec = {
+            .header = {
+                .id = RTLD_PERF_JIT_CODE_LOAD,
+                .total_size = sizeof(rec) + name_size + size,
+                .timestamp = rtld_perf_timestamp(),
+            },
+            .pid = getpid(),
+            .tid = gettid(),
+            .vma = (uintptr_t)entry,
+            .code_addr = (uintptr_t)entry,
+            .code_size = size,
+            .code_index = r->perf_index++,
+        };
+        write_full(r->perf_dump_fd, &rec, sizeof(rec));
+        write_full(r->perf_dump_fd, name, name_size);
+        write_full(r->perf_dump_fd, entry, size);
+    }
+}
+
+// Insert into the host address index. Code is mostly allocated at increasing
+// addresses, so search for the position from the end.
+static int
+rtld_ranges_insert(Rtld *r, uintptr_t start, size_t size, uintptr_t addr,
+                   RtldObject *obj)
+{
+    if (r->ranges_count == r->ranges_cap)
+        return -ENOMEM;
+
+    unsigned gen = atomic_load_explicit(&r->ranges_gen, memory_order_relaxed);
+    atomic_store_explicit(&r->ranges_gen, gen + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    size_t i = r->ranges_count;
+    for (; i > 0 && r->ranges[i - 1].start > start; i--)
+        r->ranges[i] = r->ranges[i - 1];
+    // Functions without size information get at least their first byte.
+    r->ranges[i] = (struct RtldRange){start, start + (size ? size : 1), addr, obj};
+    r->ranges_count++;
+
+    atomic_store_explicit(&r->ranges_gen, gen + 2, memory_order_release);
+    return 0;
+}
+
+int rtld_add_object(Rtld *r, void *obj_base, size_t obj_size, uint64_t skew,
+                    struct RtldAddTimes *times)
 {
     int retval;
+    uint64_t time_start = times ? stats_now() : 0;
 
     RtldElf re;
     if ((retval = rtld_elf_init(&re, obj_base, obj_size, skew, r)) < 0)
@@ -597,9 +918,11 @@ int rtld_add_object(Rtld *r, void *obj_base, size_t obj_size, uint64_t skew)
     int i;
     Elf64_Shdr *elf_shnt;
 
-    // First, check flags and determine total allocation size and alignment
-    size_t totsz = 0;
-    size_t totalign = 1;
+    // First, check flags and determine total allocation size and alignment.
+    // Code and read-only data are placed in separate arenas, so that data
+    // doesn't dilute the instruction cache and iTLB footprint of the code.
+    size_t totsz[2] = {0, 0};
+    size_t totalign[2] = {1, 1};
     for (i = 0, elf_shnt = re.re_shdr; i < re.re_ehdr->e_shnum; i++, elf_shnt++)
     {
         // We don't support more flags
@@ -608,23 +931,45 @@ int rtld_add_object(Rtld *r, void *obj_base, size_t obj_size, uint64_t skew)
             dprintf(2, "unsupported section flags\n");
             return -EINVAL;
         }
+        if (elf_shnt->sh_flags & SHF_MERGE)
+        {
+            if (rtld_merge_candidate(&re, i))
+            {
+                elf_shnt->sh_addr = 0; // allocated on demand
+                continue;
+            }
+            // Otherwise, treat it as a regular section.
+            elf_shnt->sh_flags &= ~(SHF_MERGE | SHF_STRINGS);
+        }
         if (elf_shnt->sh_flags & SHF_ALLOC)
         {
-            totsz = ALIGN_UP(totsz, elf_shnt->sh_addralign);
-            elf_shnt->sh_addr = totsz; // keep offset into allocation
-            totsz += elf_shnt->sh_size;
-            if (totalign < elf_shnt->sh_addralign)
-                totalign = elf_shnt->sh_addralign;
+            bool exec = elf_shnt->sh_flags & SHF_EXECINSTR;
+            size_t align = elf_shnt->sh_addralign ? elf_shnt->sh_addralign : 1;
+            totsz[exec] = ALIGN_UP(totsz[exec], align);
+            elf_shnt->sh_addr = totsz[exec]; // keep offset into allocation
+            totsz[exec] += elf_shnt->sh_size;
+            if (totalign[exec] < align)
+                totalign[exec] = align;
         }
     }
 
-    char *base = mem_alloc_code(totsz, totalign);
-    if (BAD_ADDR(base))
-        return (int)(uintptr_t)base;
+    char *base[2] = {NULL, NULL};
+    if (totsz[0])
+    {
+        base[0] = mem_alloc_rodata(totsz[0], totalign[0]);
+        if (BAD_ADDR(base[0]))
+            return (int)(uintptr_t)base[0];
+    }
+    if (totsz[1])
+    {
+        base[1] = mem_alloc_code(totsz[1], totalign[1]);
+        if (BAD_ADDR(base[1]))
+            return (int)(uintptr_t)base[1];
+    }
 
     for (i = 0, elf_shnt = re.re_shdr; i < re.re_ehdr->e_shnum; i++, elf_shnt++)
-        if (elf_shnt->sh_flags & SHF_ALLOC)
-            elf_shnt->sh_addr += (uintptr_t)base;
+        if ((elf_shnt->sh_flags & (SHF_ALLOC | SHF_MERGE)) == SHF_ALLOC)
+            elf_shnt->sh_addr += (uintptr_t)base[!!(elf_shnt->sh_flags & SHF_EXECINSTR)];
 
     // Second pass to resolve relocations, now that all sections are allocated.
     for (i = 0, elf_shnt = re.re_shdr; i < re.re_ehdr->e_shnum; i++, elf_shnt++)
@@ -636,17 +981,29 @@ int rtld_add_object(Rtld *r, void *obj_base, size_t obj_size, uint64_t skew)
             goto out;
     }
 
+    uint64_t time_reloc = times ? stats_now() : 0;
+
     // Third pass to actually copy code into target allocation
     for (i = 0, elf_shnt = re.re_shdr; i < re.re_ehdr->e_shnum; i++, elf_shnt++)
     {
-        if (elf_shnt->sh_type != SHT_PROGBITS)
+        if (elf_shnt->sh_type != SHT_PROGBITS || !(elf_shnt->sh_flags & SHF_ALLOC))
+            continue;
+        if (elf_shnt->sh_flags & SHF_MERGE) // interned or copied on demand
             continue;
         uint8_t *src = re.base + elf_shnt->sh_offset;
         void *dst = (void *)elf_shnt->sh_addr;
-        if ((retval = mem_write_code(dst, src, elf_shnt->sh_size)) < 0)
+        if (elf_shnt->sh_flags & SHF_EXECINSTR)
+            retval = mem_write_code(dst, src, elf_shnt->sh_size);
+        else
+            retval = mem_write_rodata(dst, src, elf_shnt->sh_size);
+        if (retval < 0)
             goto out;
     }
 
+    // Single cache maintenance operation for all sections and stubs.
+    mem_flush_code();
+    uint64_t time_copy = times ? stats_now() : 0;
+
     // Last pass to store final addresses in the hash table. This is done after
     // the code is put into its final place to avoid storing invalid addresses.
     for (i = 0, elf_shnt = re.re_shdr; i < re.re_ehdr->e_shnum; i++, elf_shnt++)
@@ -686,12 +1043,27 @@ int rtld_add_object(Rtld *r, void *obj_base, size_t obj_size, uint64_t skew)
                 dprintf(2, "invalid function name %s\n", name);
                 goto out;
             }
-            retval = rtld_set(r, addr, (void *)entry, obj_base, obj_size);
+            RtldObject *obj;
+            retval = rtld_set(r, addr, (void *)entry, obj_base, obj_size, &obj);
+            if (retval < 0)
+                goto out;
+            retval = rtld_ranges_insert(r, entry, elf_sym->st_size, addr, obj);
             if (retval < 0)
                 goto out;
+            r->stats.functions++;
+            rtld_perf_notify(r, addr, (void *)entry, elf_sym->st_size);
         }
     }
 
+    r->stats.objects++;
+    r->stats.code_bytes += totsz[1];
+    r->stats.rodata_bytes += totsz[0];
+    if (times)
+    {
+        times->reloc = time_reloc - time_start;
+        times->copy = time_copy - time_reloc;
+        times->publish = stats_now() - time_copy;
+    }
     return 0;
 
 out:
@@ -706,8 +1078,29 @@ int rtld_init(Rtld *r, const struct DispatcherInfo *disp_info)
     if (BAD_ADDR(objects))
         return (int)(uintptr_t)objects;
 
+    RtldMergeEntry *merge = rtld_merge_alloc(1 << RTLD_MERGE_BITS);
+    if (BAD_ADDR(merge))
+        return (int)(uintptr_t)merge;
+
+    // One range per linked function at most, so the index never has to move.
+    // Only pages in use are committed.
+    size_t ranges_cap = 1 << RTLD_HASH_BITS;
+    struct RtldRange *ranges = mmap(NULL, ranges_cap * sizeof(struct RtldRange),
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (BAD_ADDR(ranges))
+        return (int)(uintptr_t)ranges;
+
     r->objects = objects;
+    r->merge = merge;
+    r->merge_mask = (1 << RTLD_MERGE_BITS) - 1;
+    r->ranges = ranges;
+    r->ranges_count = 0;
+    r->ranges_cap = ranges_cap;
     r->disp_info = disp_info;
+    r->perf_map_fd = -1;
+    r->perf_dump_fd = -1;
+    r->perf_index = 0;
 
     int retval = plt_create(disp_info, &r->plt);
     if (retval < 0)
@@ -737,6 +1130,77 @@ int rtld_resolve(Rtld *r, uintptr_t addr, void **out_entry)
     return -ENOENT;
 }
 
+// Seqlock reader for the host address index. A signal handler can interrupt
+// an insertion on the same thread, so readers don't retry forever.
+#define RTLD_RANGES_RETRIES 16
+
+static bool
+rtld_ranges_read_begin(Rtld *r, unsigned *gen)
+{
+    *gen = atomic_load_explicit(&r->ranges_gen, memory_order_acquire);
+    return !(*gen & 1);
+}
+
+static bool
+rtld_ranges_read_valid(Rtld *r, unsigned gen)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&r->ranges_gen, memory_order_relaxed) == gen;
+}
+
+int rtld_lookup_host(Rtld *r, uintptr_t host_addr, uintptr_t *out_addr,
+                     void **out_entry)
+{
+    for (int retry = 0; retry < RTLD_RANGES_RETRIES; retry++)
+    {
+        unsigned gen;
+        if (!rtld_ranges_read_begin(r, &gen))
+            continue;
+
+        const struct RtldRange *ranges = r->ranges;
+        size_t lo = 0, hi = r->ranges_count;
+        while (lo < hi)
+        {
+            size_t mid = lo + (hi - lo) / 2;
+            if (ranges[mid].start <= host_addr)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        struct RtldRange range = {0};
+        if (lo)
+            range = ranges[lo - 1];
+
+        if (!rtld_ranges_read_valid(r, gen))
+            continue;
+
+        if (!lo || host_addr >= range.end)
+            return -ENOENT;
+        *out_addr = range.addr;
+        if (out_entry)
+            *out_entry = (void *)range.start;
+        return 0;
+    }
+    return -EAGAIN;
+}
+
+ssize_t rtld_ranges_copy(Rtld *r, struct RtldRange *ranges, size_t cap)
+{
+    for (int retry = 0; retry < RTLD_RANGES_RETRIES; retry++)
+    {
+        unsigned gen;
+        if (!rtld_ranges_read_begin(r, &gen))
+            continue;
+        size_t count = r->ranges_count;
+        if (count > cap)
+            return -ENOBUFS;
+        memcpy(ranges, r->ranges, count * sizeof(struct RtldRange));
+        if (rtld_ranges_read_valid(r, gen))
+            return count;
+    }
+    return -EAGAIN;
+}
+
 void rtld_patch(struct RtldPatchData *patch_data, void *sym)
 {
     // Ignore relocations failures and cases where nothing is to patch.
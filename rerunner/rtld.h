@@ -6,6 +6,33 @@
 #include "dispatcher-info.h"
 
 typedef struct RtldObject RtldObject;
+typedef struct RtldMergeEntry RtldMergeEntry;
+
+// Host code range of a linked function.
+struct RtldRange
+{
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t addr;
+    RtldObject *obj;
+};
+
+struct RtldStats
+{
+    uint64_t objects;
+    uint64_t functions;
+    uint64_t code_bytes;
+    uint64_t rodata_bytes;
+    uint64_t stubs;
+    uint64_t merge_entries;  // distinct interned entries
+    uint64_t merge_hits;     // references resolved to an existing entry
+    uint64_t merge_unshared; // entries copied privately, no free slot found
+};
+
+// Number of slots of the guest address table (log2), the upper bound for the
+// number of linked functions.
+#define RTLD_HASH_BITS 17
+
 struct Rtld
 {
     const struct DispatcherInfo *disp_info;
@@ -14,7 +41,25 @@ struct Rtld
     size_t objects_idx;
     size_t objects_cap;
 
+    // Intern table for entries of SHF_MERGE sections, shared by all objects.
+    RtldMergeEntry *merge;
+    size_t merge_mask;
+
+    // Sorted by start. Modifications are guarded by the generation counter,
+    // which is odd while an update is in progress.
+    struct RtldRange *ranges;
+    size_t ranges_count;
+    size_t ranges_cap;
+    _Atomic unsigned ranges_gen;
+
     void *plt;
+
+    struct RtldStats stats;
+
+    // perf map and jitdump output, -1 if disabled.
+    int perf_map_fd;
+    int perf_dump_fd;
+    uint64_t perf_index;
 };
 typedef struct Rtld Rtld;
 
@@ -29,10 +74,36 @@ struct RtldPatchData
 
 int rtld_init(Rtld *r, const struct DispatcherInfo *disp_info);
 
+// Report linked functions to perf through /tmp/perf-<pid>.map and/or the
+// jitdump file /tmp/jit-<pid>.dump (to be used with perf inject --jit).
+int rtld_perf_init(Rtld *r, bool map, bool jitdump);
+
 int rtld_resolve(Rtld *r, uintptr_t addr, void **out_entry);
 
-int rtld_add_object(Rtld *r, void *obj_base, size_t obj_size, uint64_t skew);
+// Durations of the steps of rtld_add_object in nanoseconds.
+struct RtldAddTimes
+{
+    uint64_t reloc;   // parsing, allocation and relocation
+    uint64_t copy;    // copy into the arenas and cache maintenance
+    uint64_t publish; // insertion into the lookup tables
+};
+
+// times is optional.
+int rtld_add_object(Rtld *r, void *obj_base, size_t obj_size, uint64_t skew,
+                    struct RtldAddTimes *times);
+
+// Map a host address in linked code to the guest address and host entry of
+// the function containing it. Safe to use from signal handlers; returns
+// -EAGAIN if the index is being modified by the interrupted code.
+int rtld_lookup_host(Rtld *r, uintptr_t host_addr, uintptr_t *out_addr,
+                     void **out_entry);
+// Copy the host address index, sorted by start, into ranges, which has room
+// for cap entries, and return the number of entries; -ENOBUFS if the index
+// is larger. Same guarantees as rtld_lookup_host.
+ssize_t rtld_ranges_copy(Rtld *r, struct RtldRange *ranges, size_t cap);
 
+// Callers must call mem_flush_code before the patched code is executed, which
+// allows flushing a batch of patches at once.
 void rtld_patch(struct RtldPatchData *patch_data, void *sym);
 
 #endif
@@ -0,0 +1,136 @@
+#include <asm/sigcontext.h>
+#include <asm/siginfo.h>
+#include <asm/signal.h>
+#include <asm/ucontext.h>
+
+#include "common.h"
+#include "cpu-state.h"
+#include "memory.h"
+#include "profile.h"
+#include "rtld.h"
+#include "sampler.h"
+#include "symbols.h"
+
+// Samples by host PC. Only written by the signal handler; SIGPROF is blocked
+// while it runs.
+static struct ProfileTable sampler_pcs;
+static const char *sampler_path;
+static long sampler_interval; // in us
+// Samples by guest function, rebuilt whenever the samples are written.
+static struct ProfileTable sampler_funcs;
+
+static void
+sampler_handler(int sig, struct siginfo *info, void *ucp)
+{
+    (void)sig;
+    (void)info;
+    struct ucontext *uc = ucp;
+#if defined(__x86_64__)
+    uintptr_t pc = uc->uc_mcontext.rip;
+#elif defined(__aarch64__)
+    uintptr_t pc = uc->uc_mcontext.pc;
+#else
+#error "missing PC in signal context"
+#endif
+    // Bounded by PROFILE_PROBES; samples of new PCs are dropped once the
+    // table gets crowded.
+    profile_table_add(&sampler_pcs, pc, 1);
+}
+
+static int
+sampler_arm(long interval)
+{
+    struct itimerval timer = {
+        .it_interval = {.tv_sec = 0, .tv_usec = interval},
+        .it_value = {.tv_sec = 0, .tv_usec = interval},
+    };
+    return setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+int sampler_init(unsigned frequency, const char *path)
+{
+    if (!frequency || frequency > 1000000)
+        return -EINVAL;
+
+    int ret = profile_table_init(&sampler_pcs, 16);
+    if (ret < 0)
+        return ret;
+    ret = profile_table_init(&sampler_funcs, 16);
+    if (ret < 0)
+        return ret;
+    sampler_path = path;
+
+    struct sigaction act;
+    act.sa_handler = (void (*)())sampler_handler;
+    act.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&act.sa_mask);
+    ret = sigaction(SAMPLER_SIGNAL, &act, NULL);
+    if (ret < 0)
+        return ret;
+
+    sampler_interval = 1000000 / frequency;
+    return sampler_arm(sampler_interval);
+}
+
+int sampler_resume(void)
+{
+    if (!sampler_path)
+        return -EINVAL;
+    return sampler_arm(sampler_interval);
+}
+
+bool sampler_enabled(void)
+{
+    return sampler_path != NULL;
+}
+
+int sampler_finish(struct State *state)
+{
+    sampler_arm(0);
+
+    // Samples outside of translated code are spent in the runner itself
+    // (dispatcher, linking, syscall emulation) or in the kernel on its behalf.
+    // Samples in the code arena outside of functions are in the PLT or stubs.
+    struct ProfileTable by_func = sampler_funcs;
+    memset(by_func.entries, 0, (by_func.mask + 1) * sizeof(struct ProfileEntry));
+    uint64_t runtime = 0;
+    uint64_t unknown = 0;
+    for (size_t i = 0; i <= sampler_pcs.mask; i++)
+    {
+        struct ProfileEntry *entry = &sampler_pcs.entries[i];
+        if (!entry->addr)
+            continue;
+        uintptr_t guest = 0;
+        if (!mem_code_contains(entry->addr))
+            runtime += entry->count;
+        else if (rtld_lookup_host(&state->rtld, entry->addr, &guest, NULL) == 0)
+            profile_table_add(&by_func, guest, entry->count);
+        else
+            unknown += entry->count;
+    }
+    by_func.dropped += sampler_pcs.dropped;
+
+    int fd = open(sampler_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return fd;
+    size_t count = profile_table_sort(&by_func);
+    for (size_t i = 0; i < count; i++)
+    {
+        char name[256];
+        uintptr_t addr = by_func.entries[i].addr;
+        if (symbols_format(addr, name, sizeof(name)) < 0)
+            snprintf(name, sizeof(name), "guest_%lx", addr);
+        dprintf(fd, "translated;%s %lu\n", name, by_func.entries[i].count);
+    }
+    if (unknown)
+        dprintf(fd, "translated;[unknown] %lu\n", unknown);
+    if (runtime)
+        dprintf(fd, "instrew %lu\n", runtime);
+    if (by_func.dropped)
+        dprintf(fd, "[dropped] %lu\n", by_func.dropped);
+    close(fd);
+    if (by_func.dropped)
+        dprintf(2, "warning: sample table full, dropped %lu samples\n",
+                by_func.dropped);
+    return 0;
+}
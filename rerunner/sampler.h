@@ -0,0 +1,22 @@
+#ifndef _INSTREW_RUNNER_SAMPLER_H
+#define _INSTREW_RUNNER_SAMPLER_H
+
+#include "common.h"
+
+struct State;
+
+// Sampling profiler: SIGPROF is reserved for the runner while it is active and
+// samples the host PC at a fixed frequency of CPU time. At exit, samples are
+// attributed to guest functions and written in folded-stack format, suitable
+// for flamegraph.pl and similar tools.
+#define SAMPLER_SIGNAL SIGPROF
+#define SAMPLER_FILE_NAME "samples.folded"
+
+int sampler_init(unsigned frequency, const char *path);
+bool sampler_enabled(void);
+// Restart sampling after sampler_finish; samples accumulate.
+int sampler_resume(void);
+// Stop sampling and write the samples.
+int sampler_finish(struct State *state);
+
+#endif
@@ -0,0 +1,207 @@
+#include <stdatomic.h>
+
+#include "common.h"
+#include "cpu-state.h"
+#include "livestats.h"
+#include "memory.h"
+#include "perfctr.h"
+#include "stats.h"
+#include "symbols.h"
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static const char *const stats_stage_names[STATS_STAGE_COUNT] = {
+    [STATS_STAGE_LOOKUP] = "lookup",
+    [STATS_STAGE_OPEN] = "open",
+    [STATS_STAGE_STAT] = "stat",
+    [STATS_STAGE_READ] = "read",
+    [STATS_STAGE_RELOC] = "reloc",
+    [STATS_STAGE_COPY] = "copy",
+    [STATS_STAGE_PUBLISH] = "publish",
+    [STATS_STAGE_PATCH] = "patch",
+};
+
+static size_t
+stats_hist_bucket(uint64_t value)
+{
+    if (value < (1u << STATS_HIST_SUB_BITS))
+        return value;
+    unsigned exp = 63 - __builtin_clzl(value);
+    if (exp >= STATS_HIST_MAX_BITS)
+        return STATS_HIST_BUCKETS - 1;
+    size_t sub = (value >> (exp - STATS_HIST_SUB_BITS)) & ((1u << STATS_HIST_SUB_BITS) - 1);
+    return ((exp - STATS_HIST_SUB_BITS + 1) << STATS_HIST_SUB_BITS) + sub;
+}
+
+// Smallest value that falls into the bucket.
+static uint64_t
+stats_hist_bucket_start(size_t bucket)
+{
+    if (bucket < (1u << STATS_HIST_SUB_BITS))
+        return bucket;
+    unsigned exp = (bucket >> STATS_HIST_SUB_BITS) + STATS_HIST_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1u << STATS_HIST_SUB_BITS) - 1);
+    return ((1ul << STATS_HIST_SUB_BITS) + sub) << (exp - STATS_HIST_SUB_BITS);
+}
+
+void stats_hist_add(struct StatsHist *hist, uint64_t value)
+{
+    hist->count++;
+    hist->sum += value;
+    if (value > hist->max)
+        hist->max = value;
+    hist->buckets[stats_hist_bucket(value)]++;
+}
+
+// Upper bound of the value below which the fraction permille/1000 of the
+// samples lie.
+static uint64_t
+stats_hist_percentile(const struct StatsHist *hist, unsigned permille)
+{
+    uint64_t rank = (hist->count * permille + 999) / 1000;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < STATS_HIST_BUCKETS - 1; i++)
+    {
+        seen += hist->buckets[i];
+        if (seen >= rank)
+        {
+            uint64_t end = stats_hist_bucket_start(i + 1) - 1;
+            return end < hist->max ? end : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+static atomic_flag stats_merge_lock = ATOMIC_FLAG_INIT;
+
+void stats_merge_thread(struct CpuState *cpu_state)
+{
+    struct Stats *s = &cpu_state->state->stats;
+    struct StatsThread *ts = &cpu_state->stats;
+
+    // The live statistics keep totals of their own.
+    livestats_flush_thread(cpu_state);
+    while (atomic_flag_test_and_set_explicit(&stats_merge_lock, memory_order_acquire))
+        ;
+    s->dispatches += ts->dispatches;
+    s->tlb_misses += ts->tlb_misses;
+    s->syscalls += ts->syscalls;
+    ts->dispatches = ts->tlb_misses = ts->syscalls = 0;
+    ts->live_dispatches = ts->live_tlb_misses = ts->live_syscalls = 0;
+    for (size_t i = 0; i < STATS_STAGE_COUNT; i++)
+    {
+        struct StatsHist *dst = &s->stages[i];
+        struct StatsHist *src = &ts->stages[i];
+        dst->count += src->count;
+        dst->sum += src->sum;
+        if (src->max > dst->max)
+            dst->max = src->max;
+        for (size_t j = 0; j < STATS_HIST_BUCKETS; j++)
+            dst->buckets[j] += src->buckets[j];
+        memset(src, 0, sizeof(*src));
+    }
+    for (size_t i = 0; i < STATS_SYSCALLS; i++)
+    {
+        struct StatsSyscall *dst = &s->syscall_nrs[i];
+        struct StatsSyscall *src = &ts->syscall_nrs[i];
+        dst->count += src->count;
+        dst->time += src->time;
+        if (src->max > dst->max)
+            dst->max = src->max;
+        memset(src, 0, sizeof(*src));
+    }
+    atomic_flag_clear_explicit(&stats_merge_lock, memory_order_release);
+}
+
+void stats_print(struct CpuState *cpu_state)
+{
+    if (cpu_state->state->stats_fd >= 0)
+        stats_print_fd(cpu_state, cpu_state->state->stats_fd);
+}
+
+void stats_print_fatal(void)
+{
+    // A fatal signal can arrive while printing.
+    static atomic_flag printed = ATOMIC_FLAG_INIT;
+    struct CpuState *cpu_state = get_thread_area();
+    if (cpu_state && !atomic_flag_test_and_set(&printed))
+        stats_print(cpu_state);
+}
+
+void stats_print_fd(struct CpuState *cpu_state, int fd)
+{
+    struct State *state = cpu_state->state;
+    stats_merge_thread(cpu_state);
+
+    const struct Stats *s = &state->stats;
+    dprintf(fd, "dispatch.count: %lu\n", s->dispatches);
+    // Misses also count resolves for patching and a failed last dispatch.
+    uint64_t tlb_hits = s->dispatches > s->tlb_misses ? s->dispatches - s->tlb_misses : 0;
+    dprintf(fd, "dispatch.tlb_hits: %lu\n", tlb_hits);
+    dprintf(fd, "dispatch.tlb_misses: %lu\n", s->tlb_misses);
+    dprintf(fd, "syscall.count: %lu\n", s->syscalls);
+
+    uint64_t syscall_time = 0;
+    for (size_t i = 0; i < STATS_SYSCALLS; i++)
+    {
+        const struct StatsSyscall *entry = &s->syscall_nrs[i];
+        bool unhandled = s->syscall_unhandled[i / 64] & (1ull << i % 64);
+        if (!entry->count && !unhandled)
+            continue;
+        const char *suffix = i == STATS_SYSCALLS - 1 ? "+" : "";
+        syscall_time += entry->time;
+        dprintf(fd, "syscall.%lu%s.count: %lu\n", i, suffix, entry->count);
+        dprintf(fd, "syscall.%lu%s.time_ns: %lu\n", i, suffix, entry->time);
+        dprintf(fd, "syscall.%lu%s.max_ns: %lu\n", i, suffix, entry->max);
+        if (unhandled)
+            dprintf(fd, "syscall.%lu%s.unhandled: 1\n", i, suffix);
+    }
+    dprintf(fd, "syscall.time_total_ns: %lu\n", syscall_time);
+
+    dprintf(fd, "load.resolves: %lu\n", s->resolves);
+    dprintf(fd, "load.objects: %lu\n", s->loads);
+    dprintf(fd, "load.bytes: %lu\n", s->load_bytes);
+    dprintf(fd, "load.patches: %lu\n", s->patches);
+    uint64_t total = 0;
+    for (size_t i = 0; i < STATS_STAGE_COUNT; i++)
+    {
+        const struct StatsHist *hist = &s->stages[i];
+        const char *name = stats_stage_names[i];
+        total += hist->sum;
+        dprintf(fd, "load.%s.count: %lu\n", name, hist->count);
+        dprintf(fd, "load.%s.time_ns: %lu\n", name, hist->sum);
+        if (!hist->count)
+            continue;
+        dprintf(fd, "load.%s.p50_ns: %lu\n", name, stats_hist_percentile(hist, 500));
+        dprintf(fd, "load.%s.p90_ns: %lu\n", name, stats_hist_percentile(hist, 900));
+        dprintf(fd, "load.%s.p99_ns: %lu\n", name, stats_hist_percentile(hist, 990));
+        dprintf(fd, "load.%s.p999_ns: %lu\n", name, stats_hist_percentile(hist, 999));
+        dprintf(fd, "load.%s.max_ns: %lu\n", name, hist->max);
+    }
+    dprintf(fd, "load.time_total_ns: %lu\n", total);
+
+    if (s->time_guest)
+        dprintf(fd, "startup.guest_ns: %lu\n", s->time_guest - s->time_main);
+    for (size_t i = 0, n = 1; i < STATS_LOAD_MILESTONES; i++, n *= 10)
+        if (s->time_loads[i])
+            dprintf(fd, "startup.load_%lu_ns: %lu\n", n, s->time_loads[i] - s->time_main);
+
+    const struct RtldStats *rs = &state->rtld.stats;
+    dprintf(fd, "rtld.objects: %lu\n", rs->objects);
+    dprintf(fd, "rtld.functions: %lu\n", rs->functions);
+    dprintf(fd, "rtld.code_bytes: %lu\n", rs->code_bytes);
+    dprintf(fd, "rtld.rodata_bytes: %lu\n", rs->rodata_bytes);
+    dprintf(fd, "rtld.stubs: %lu\n", rs->stubs);
+    dprintf(fd, "rtld.merge_entries: %lu\n", rs->merge_entries);
+    dprintf(fd, "rtld.merge_hits: %lu\n", rs->merge_hits);
+    dprintf(fd, "rtld.merge_unshared: %lu\n", rs->merge_unshared);
+
+    mem_print_stats(fd);
+    perfctr_print_stats(fd);
+    symbols_print_stats(fd);
+}
@@ -0,0 +1,145 @@
+#ifndef _INSTREW_RUNNER_STATS_H
+#define _INSTREW_RUNNER_STATS_H
+
+#include "common.h"
+
+struct State;
+struct CpuState;
+
+// Stages of a quick TLB miss, each with its own latency histogram.
+enum StatsStage
+{
+    STATS_STAGE_LOOKUP, // rtld table lookup, only timed with -stats
+    STATS_STAGE_OPEN,
+    STATS_STAGE_STAT,
+    STATS_STAGE_READ,
+    STATS_STAGE_RELOC,   // rtld_add_object up to and including relocation
+    STATS_STAGE_COPY,    // copy into the code arena and cache maintenance
+    STATS_STAGE_PUBLISH, // symbol table insertion and perf notification
+    STATS_STAGE_PATCH,
+    STATS_STAGE_COUNT,
+};
+
+// Log-linear latency histogram in nanoseconds: every power of two is split
+// into 2^STATS_HIST_SUB_BITS buckets, giving a relative error below 12.5%.
+// Values from 2^STATS_HIST_MAX_BITS ns (about 18 minutes) on share the last
+// bucket.
+#define STATS_HIST_SUB_BITS 3
+#define STATS_HIST_MAX_BITS 40
+#define STATS_HIST_BUCKETS ((STATS_HIST_MAX_BITS - STATS_HIST_SUB_BITS + 1) << STATS_HIST_SUB_BITS)
+
+struct StatsHist
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint32_t buckets[STATS_HIST_BUCKETS];
+};
+
+void stats_hist_add(struct StatsHist *hist, uint64_t value);
+
+// Guest syscall numbers with their own profile entry; higher numbers share
+// the last one.
+#define STATS_SYSCALLS 512
+
+struct StatsSyscall
+{
+    uint64_t count;
+    uint64_t time; // ns, only measured with -stats or -trace
+    uint64_t max;
+};
+
+// Per-thread counters, updated without synchronization.
+struct StatsThread
+{
+    uint64_t dispatches;
+    uint64_t tlb_misses;
+    uint64_t syscalls;
+
+    struct StatsHist stages[STATS_STAGE_COUNT];
+    struct StatsSyscall syscall_nrs[STATS_SYSCALLS];
+
+    // Values of the counters above already added to the live statistics,
+    // and slow-path events until they are checked next.
+    uint64_t live_dispatches;
+    uint64_t live_tlb_misses;
+    uint64_t live_syscalls;
+    uint64_t live_countdown;
+};
+
+// Loads after which the startup time is recorded: 1, 10, ..., 10^7.
+#define STATS_LOAD_MILESTONES 8
+
+// Counters of the miss path, shared by all threads.
+struct Stats
+{
+    uint64_t resolves; // quick TLB misses found in the rtld table
+    uint64_t loads;
+    uint64_t load_bytes;
+    uint64_t patches;
+
+    // Startup timestamps: main was entered, the guest was entered, and the
+    // 10^i-th object was loaded; 0 if not reached.
+    uint64_t time_main;
+    uint64_t time_guest;
+    uint64_t time_loads[STATS_LOAD_MILESTONES];
+    uint64_t next_milestone;
+
+    // Per-thread counters merged from exited threads (and from the thread
+    // printing the statistics); preloading records histograms here directly.
+    uint64_t dispatches;
+    uint64_t tlb_misses;
+    uint64_t syscalls;
+    struct StatsHist stages[STATS_STAGE_COUNT];
+    struct StatsSyscall syscall_nrs[STATS_SYSCALLS];
+    // Syscalls the guest issued but the runner doesn't implement; each one
+    // is warned about only once.
+    uint64_t syscall_unhandled[STATS_SYSCALLS / 64];
+};
+
+uint64_t stats_now(void);
+
+static inline struct StatsSyscall *
+stats_syscall(struct StatsSyscall *syscalls, uint64_t nr)
+{
+    return &syscalls[nr < STATS_SYSCALLS ? nr : STATS_SYSCALLS - 1];
+}
+
+// Add the duration of a syscall; start is 0 if it wasn't timed.
+static inline void
+stats_syscall_time(struct StatsSyscall *entry, uint64_t start, uint64_t end)
+{
+    if (!start)
+        return;
+    entry->time += end - start;
+    if (end - start > entry->max)
+        entry->max = end - start;
+}
+
+// Record the time of the current load if it is a milestone.
+static inline void
+stats_load_milestone(struct Stats *s)
+{
+    if (UNLIKELY(s->loads == s->next_milestone))
+    {
+        unsigned i = 0;
+        for (uint64_t n = 1; n < s->loads; n *= 10)
+            i++;
+        if (i < STATS_LOAD_MILESTONES)
+            s->time_loads[i] = stats_now();
+        s->next_milestone *= 10;
+    }
+}
+
+// Merge the counters of a thread into State::stats and reset them. Called
+// when a thread exits and before printing.
+void stats_merge_thread(struct CpuState *cpu_state);
+
+// Print all statistics to State::stats_fd, if enabled.
+void stats_print(struct CpuState *cpu_state);
+void stats_print_fd(struct CpuState *cpu_state, int fd);
+// Print statistics before the runner terminates on a fatal error, at most
+// once and only if the current thread runs guest code.
+void stats_print_fatal(void);
+
+#endif
@@ -0,0 +1,334 @@
+#include <stdatomic.h>
+#include <elf.h>
+#include <linux/fcntl.h>
+#include <linux/fs.h>
+#include <linux/limits.h>
+#include <linux/mman.h>
+
+#include "common.h"
+#include "memory.h"
+#include "symbols.h"
+
+#define SYMBOLS_MAX_FILES 64
+#define SYMBOLS_MAX_IMAGES 256
+
+struct SymbolsEntry
+{
+    uint64_t value;
+    uint64_t size;
+    uint32_t name;
+};
+
+struct SymbolsFile
+{
+    const char *path;
+    const char *name; // basename of path
+    bool parsed;      // also set if parsing failed, then count is zero
+
+    // Mapping of the whole file, kept for the string table.
+    const void *map;
+    size_t map_size;
+    const char *strtab;
+    size_t strtab_size;
+    struct SymbolsEntry *syms; // sorted by value
+    size_t count;
+};
+
+struct SymbolsImage
+{
+    uintptr_t start;
+    uintptr_t end;
+    uint64_t offset;
+    struct SymbolsFile *file;
+    bool has_bias;
+    uintptr_t bias;
+};
+
+static struct SymbolsFile symbols_files[SYMBOLS_MAX_FILES];
+static size_t symbols_file_count;
+static struct SymbolsImage symbols_images[SYMBOLS_MAX_IMAGES];
+static size_t symbols_image_count;
+static size_t symbols_dropped;
+// Guest threads may map libraries concurrently; reports are rare.
+static atomic_flag symbols_lock = ATOMIC_FLAG_INIT;
+
+static void
+symbols_lock_acquire(void)
+{
+    while (atomic_flag_test_and_set_explicit(&symbols_lock, memory_order_acquire))
+        ;
+}
+
+static void
+symbols_lock_release(void)
+{
+    atomic_flag_clear_explicit(&symbols_lock, memory_order_release);
+}
+
+static struct SymbolsFile *
+symbols_get_file(const char *path)
+{
+    for (size_t i = 0; i < symbols_file_count; i++)
+        if (!strcmp(symbols_files[i].path, path))
+            return &symbols_files[i];
+    if (symbols_file_count == SYMBOLS_MAX_FILES)
+        return NULL;
+
+    size_t len = strlen(path);
+    char *copy = mem_alloc_data(len + 1, 1);
+    if (BAD_ADDR(copy))
+        return NULL;
+    memcpy(copy, path, len + 1);
+
+    struct SymbolsFile *file = &symbols_files[symbols_file_count++];
+    file->path = copy;
+    file->name = copy;
+    for (const char *c = copy; *c; c++)
+        if (*c == '/')
+            file->name = c + 1;
+    return file;
+}
+
+void symbols_add_image(int fd, uintptr_t start, uintptr_t end, uint64_t offset)
+{
+    // The path is resolved now, the fd is usually closed right afterwards and
+    // relative paths might not be valid anymore when reporting.
+    char proc_path[32];
+    char path[PATH_MAX];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%u", fd);
+    ssize_t len = readlinkat(AT_FDCWD, proc_path, path, sizeof(path) - 1);
+    if (len <= 0)
+        return;
+    path[len] = 0;
+
+    symbols_lock_acquire();
+    struct SymbolsFile *file = symbols_get_file(path);
+    if (!file || symbols_image_count == SYMBOLS_MAX_IMAGES)
+    {
+        symbols_dropped++;
+        goto out;
+    }
+    symbols_images[symbols_image_count++] = (struct SymbolsImage){
+        .start = start,
+        .end = end,
+        .offset = offset,
+        .file = file,
+    };
+out:
+    symbols_lock_release();
+}
+
+void symbols_guest_mmap(uintptr_t addr, size_t length, int prot, int flags,
+                        int fd, uint64_t offset)
+{
+    if (BAD_ADDR(addr) || !(prot & PROT_EXEC) || (flags & MAP_ANONYMOUS) || fd < 0)
+        return;
+    symbols_add_image(fd, addr, addr + length, offset);
+}
+
+static int
+symbols_entry_cmp(const void *a, const void *b)
+{
+    const struct SymbolsEntry *ea = a, *eb = b;
+    return ea->value < eb->value ? -1 : ea->value > eb->value;
+}
+
+static bool
+symbols_range_valid(const struct SymbolsFile *file, uint64_t off, uint64_t size)
+{
+    return off <= file->map_size && size <= file->map_size - off;
+}
+
+static int
+symbols_parse(struct SymbolsFile *file)
+{
+    int fd = open(file->path, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+        return fd;
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < (off_t)sizeof(Elf64_Ehdr))
+    {
+        close(fd);
+        return size < 0 ? (int)size : -ENOEXEC;
+    }
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (BAD_ADDR(map))
+        return (int)(uintptr_t)map;
+    file->map = map;
+    file->map_size = size;
+
+    const Elf64_Ehdr *ehdr = map;
+    if (memcmp(ehdr, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != ELFCLASS64)
+        return -ENOEXEC;
+    if (ehdr->e_shentsize != sizeof(Elf64_Shdr) ||
+        !symbols_range_valid(file, ehdr->e_shoff, ehdr->e_shnum * sizeof(Elf64_Shdr)))
+        return -ENOEXEC;
+
+    // Prefer the full symbol table, stripped binaries only have .dynsym.
+    const Elf64_Shdr *shdrs = (const void *)((const char *)map + ehdr->e_shoff);
+    const Elf64_Shdr *symtab = NULL;
+    for (unsigned i = 0; i < ehdr->e_shnum; i++)
+    {
+        if (shdrs[i].sh_type == SHT_SYMTAB)
+            symtab = &shdrs[i];
+        else if (shdrs[i].sh_type == SHT_DYNSYM && !symtab)
+            symtab = &shdrs[i];
+    }
+    if (!symtab || symtab->sh_entsize != sizeof(Elf64_Sym) ||
+        symtab->sh_link >= ehdr->e_shnum)
+        return -ENOENT;
+    const Elf64_Shdr *strtab = &shdrs[symtab->sh_link];
+    if (!symbols_range_valid(file, symtab->sh_offset, symtab->sh_size) ||
+        !symbols_range_valid(file, strtab->sh_offset, strtab->sh_size))
+        return -ENOEXEC;
+    file->strtab = (const char *)map + strtab->sh_offset;
+    file->strtab_size = strtab->sh_size;
+
+    const Elf64_Sym *elf_syms = (const void *)((const char *)map + symtab->sh_offset);
+    size_t elf_count = symtab->sh_size / sizeof(Elf64_Sym);
+    if (!elf_count)
+        return 0;
+    size_t syms_size = ALIGN_UP(elf_count * sizeof(struct SymbolsEntry), getpagesize());
+    struct SymbolsEntry *syms = mmap(NULL, syms_size, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (BAD_ADDR(syms))
+        return (int)(uintptr_t)syms;
+
+    size_t count = 0;
+    for (size_t i = 0; i < elf_count; i++)
+    {
+        const Elf64_Sym *sym = &elf_syms[i];
+        unsigned type = ELF64_ST_TYPE(sym->st_info);
+        if (type != STT_FUNC && type != STT_GNU_IFUNC)
+            continue;
+        if (sym->st_shndx == SHN_UNDEF || !sym->st_value ||
+            sym->st_name >= file->strtab_size)
+            continue;
+        syms[count++] = (struct SymbolsEntry){
+            .value = sym->st_value,
+            .size = sym->st_size,
+            .name = sym->st_name,
+        };
+    }
+    qsort(syms, count, sizeof(struct SymbolsEntry), symbols_entry_cmp);
+    file->syms = syms;
+    file->count = count;
+    return 0;
+}
+
+// Find the load bias of an image from the segment with the mapped offset.
+static bool
+symbols_image_bias(struct SymbolsImage *image)
+{
+    if (image->has_bias)
+        return true;
+
+    const struct SymbolsFile *file = image->file;
+    if (!file->map)
+        return false;
+    const Elf64_Ehdr *ehdr = file->map;
+    if (ehdr->e_phentsize != sizeof(Elf64_Phdr) ||
+        !symbols_range_valid(file, ehdr->e_phoff, ehdr->e_phnum * sizeof(Elf64_Phdr)))
+        return false;
+    const Elf64_Phdr *phdrs = (const void *)((const char *)file->map + ehdr->e_phoff);
+    size_t pagesz = getpagesize();
+    for (unsigned i = 0; i < ehdr->e_phnum; i++)
+    {
+        if (phdrs[i].p_type != PT_LOAD)
+            continue;
+        if (ALIGN_DOWN(phdrs[i].p_offset, pagesz) != image->offset)
+            continue;
+        image->bias = image->start - ALIGN_DOWN(phdrs[i].p_vaddr, pagesz);
+        image->has_bias = true;
+        return true;
+    }
+    return false;
+}
+
+static const struct SymbolsEntry *
+symbols_find(const struct SymbolsFile *file, uint64_t vaddr)
+{
+    // Last symbol starting at or before vaddr.
+    size_t lo = 0, hi = file->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (file->syms[mid].value <= vaddr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (!lo)
+        return NULL;
+    const struct SymbolsEntry *sym = &file->syms[lo - 1];
+    // Symbols without size (often hand-written assembly) cover everything up
+    // to the next symbol.
+    if (sym->size && vaddr - sym->value >= sym->size)
+        return NULL;
+    return sym;
+}
+
+int symbols_format(uintptr_t addr, char *buf, size_t size)
+{
+    int ret = -ENOENT;
+    symbols_lock_acquire();
+
+    // Search backwards, later mappings replace earlier ones.
+    struct SymbolsImage *image = NULL;
+    for (size_t i = symbols_image_count; i > 0; i--)
+    {
+        if (addr >= symbols_images[i - 1].start && addr < symbols_images[i - 1].end)
+        {
+            image = &symbols_images[i - 1];
+            break;
+        }
+    }
+    if (!image)
+        goto out;
+
+    struct SymbolsFile *file = image->file;
+    if (!file->parsed)
+    {
+        file->parsed = true;
+        symbols_parse(file);
+    }
+    if (!symbols_image_bias(image))
+    {
+        snprintf(buf, size, "%s@0x%lx", file->name, addr - image->start + image->offset);
+        ret = 0;
+        goto out;
+    }
+
+    uint64_t vaddr = addr - image->bias;
+    const struct SymbolsEntry *sym = symbols_find(file, vaddr);
+    if (!sym)
+        snprintf(buf, size, "%s+0x%lx", file->name, vaddr);
+    else if (vaddr == sym->value)
+        snprintf(buf, size, "%s!%s", file->name, file->strtab + sym->name);
+    else
+        snprintf(buf, size, "%s!%s+0x%lx", file->name, file->strtab + sym->name,
+                 vaddr - sym->value);
+    ret = 0;
+
+out:
+    symbols_lock_release();
+    return ret;
+}
+
+void symbols_print_stats(int fd)
+{
+    size_t parsed = 0, count = 0;
+    symbols_lock_acquire();
+    for (size_t i = 0; i < symbols_file_count; i++)
+    {
+        parsed += symbols_files[i].parsed;
+        count += symbols_files[i].count;
+    }
+    dprintf(fd, "symbols.images: %lu\n", symbols_image_count);
+    dprintf(fd, "symbols.dropped: %lu\n", symbols_dropped);
+    dprintf(fd, "symbols.files: %lu\n", symbols_file_count);
+    dprintf(fd, "symbols.files_parsed: %lu\n", parsed);
+    dprintf(fd, "symbols.functions: %lu\n", count);
+    symbols_lock_release();
+}
@@ -0,0 +1,25 @@
+#ifndef _INSTREW_RUNNER_SYMBOLS_H
+#define _INSTREW_RUNNER_SYMBOLS_H
+
+#include "common.h"
+
+// Symbolization of guest addresses for diagnostics. Executable mappings of the
+// guest binary, its interpreter and libraries mapped later are recorded by
+// path only; the symbol table (.symtab, or .dynsym if stripped) of a file is
+// read the first time an address inside it is formatted.
+
+// Record an executable file mapping of fd at [start, end) with file offset
+// offset. Failures are ignored, the range is then just not symbolized.
+void symbols_add_image(int fd, uintptr_t start, uintptr_t end, uint64_t offset);
+// Record the result of a guest mmap, if it maps a file as executable.
+void symbols_guest_mmap(uintptr_t addr, size_t length, int prot, int flags,
+                        int fd, uint64_t offset);
+
+// Format addr as "file!symbol+0xoff", or "file+0xoff" (relative to the ELF
+// addresses) if there is no covering symbol. Returns -ENOENT if addr is not
+// inside a recorded mapping.
+int symbols_format(uintptr_t addr, char *buf, size_t size);
+
+void symbols_print_stats(int fd);
+
+#endif
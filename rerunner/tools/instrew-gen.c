@@ -0,0 +1,408 @@
+// Generator of synthetic instrew caches for the host ISA.
+//
+// Usage: instrew-gen [options] <cache dir>
+//
+// Writes one relocatable object per guest function, named by its address as
+// the rerunner expects, together with a tiny x86-64 guest binary and the
+// user_args file, so that the directory can be run directly:
+//
+//   instrew-gen -functions=100000 /tmp/cache && instrew-rerunner /tmp/cache
+//
+// The functions form a tree rooted at the entry point: every function counts
+// its execution in guest register rdi and calls its children, and the root
+// finally exits with the count as status. Running the cache therefore loads
+// and executes every function exactly once. Calls use Z (absolute) or S
+// (relative) names; some calls are tail calls through instrew_tail_cdecl.
+// Additionally, every function has cold call sites to random functions and
+// PLT entries and references to its read-only data, which are linked but
+// never executed.
+//
+// Options:
+//   -functions=N   number of functions (default 1000)
+//   -fanout=N      children per function (default 2)
+//   -cold=N        cold call sites per function (default 4)
+//   -rodata=N      bytes of read-only data per function (default 32)
+//   -refs=N        references to the read-only data per function (default 2)
+//   -relative=P    percentage of S names (default 50)
+//   -tail=P        percentage of functions that tail-call their last child
+//                  (default 25)
+//   -base=ADDR     address of the first function (default 0x401000)
+//   -stride=N      distance between functions (default 0x40)
+//   -seed=N        seed for the random choices (default 1)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bench/objgen.h"
+
+// Guest registers of the x86-64 register file.
+#define GEN_REG_RAX 1
+#define GEN_REG_RDI 8
+
+struct GenConfig
+{
+    uint64_t functions;
+    unsigned fanout;
+    unsigned cold;
+    unsigned rodata;
+    unsigned refs;
+    unsigned relative;
+    unsigned tail;
+    uint64_t base;
+    uint64_t stride;
+    uint64_t seed;
+};
+
+struct GenTotals
+{
+    uint64_t bytes;
+    uint64_t relas;
+    uint64_t tails;
+};
+
+// PLT entries referenced from cold call sites.
+static const char *const gen_plt_names[] = {
+    "floor", "ceil", "fma", "memset", "cpuid", "__udivti3", "instrew_call_cdecl",
+};
+#define GEN_PLT_COUNT (sizeof(gen_plt_names) / sizeof(*gen_plt_names))
+
+static uint64_t gen_rand_state;
+
+static uint64_t
+gen_rand(void)
+{
+    // xorshift64*
+    gen_rand_state ^= gen_rand_state >> 12;
+    gen_rand_state ^= gen_rand_state << 25;
+    gen_rand_state ^= gen_rand_state >> 27;
+    return gen_rand_state * 0x2545f4914f6cdd1dull;
+}
+
+static bool
+gen_chance(unsigned percent)
+{
+    return gen_rand() % 100 < percent;
+}
+
+static uint64_t
+gen_addr(const struct GenConfig *cfg, uint64_t index)
+{
+    return cfg->base + index * cfg->stride;
+}
+
+// Name of the function at target as referenced from the function at self.
+static void
+gen_name(const struct GenConfig *cfg, char *buf, uint64_t self, uint64_t target)
+{
+    if (gen_chance(cfg->relative))
+        objgen_name(buf, 'S', target - self);
+    else
+        objgen_name(buf, 'Z', target);
+}
+
+static int
+gen_write_file(const char *dir, const char *name, const void *data, size_t size,
+               mode_t mode)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    if (fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+    const char *buf = data;
+    while (size)
+    {
+        ssize_t ret = write(fd, buf, size);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        buf += ret;
+        size -= ret;
+    }
+    return close(fd);
+}
+
+static int
+gen_function(const struct GenConfig *cfg, uint64_t index, void *buf,
+             const struct ObjgenLimits *limits, struct GenTotals *totals,
+             const char *dir)
+{
+    struct Objgen og;
+    objgen_init(&og, buf, limits);
+
+    uint64_t self = gen_addr(cfg, index);
+    uint64_t first_child = index * cfg->fanout + 1;
+    uint64_t children = 0;
+    if (cfg->fanout && first_child < cfg->functions)
+        children = cfg->functions - first_child < cfg->fanout
+                       ? cfg->functions - first_child : cfg->fanout;
+    bool tail = index && children && gen_chance(cfg->tail);
+
+    uint8_t rodata[cfg->rodata ? cfg->rodata : 1];
+    for (size_t i = 0; i < cfg->rodata; i++)
+        rodata[i] = gen_rand();
+    if (cfg->rodata && objgen_rodata(&og, rodata, cfg->rodata) < 0)
+        return -1;
+
+    char name[OBJGEN_NAME_SIZE];
+    gen_name(cfg, name, self, self);
+    if (objgen_func_begin(&og, name, children || cfg->cold || !index) < 0)
+        return -1;
+    if (objgen_func_add_reg(&og, GEN_REG_RDI, 1) < 0)
+        return -1;
+    for (unsigned i = 0; i < cfg->refs; i++)
+    {
+        int64_t off = cfg->rodata ? gen_rand() % cfg->rodata : 0;
+        if (objgen_func_ref(&og, OBJGEN_SYM_RODATA, off) < 0)
+            return -1;
+    }
+
+    for (uint64_t i = 0; i < children - tail; i++)
+    {
+        uint64_t target = gen_addr(cfg, first_child + i);
+        gen_name(cfg, name, self, target);
+        size_t sym = objgen_undef(&og, name);
+        if (!sym || objgen_func_set_pc(&og, target) < 0 ||
+            objgen_func_call(&og, sym, 0) < 0)
+            return -1;
+    }
+
+    if (cfg->cold)
+    {
+        size_t plt_syms[GEN_PLT_COUNT] = {0};
+        ptrdiff_t cold = objgen_func_cold_begin(&og);
+        for (unsigned i = 0; i < cfg->cold; i++)
+        {
+            size_t sym;
+            if (gen_chance(25))
+            {
+                size_t plt = gen_rand() % GEN_PLT_COUNT;
+                if (!plt_syms[plt])
+                    plt_syms[plt] = objgen_undef(&og, gen_plt_names[plt]);
+                sym = plt_syms[plt];
+            }
+            else
+            {
+                gen_name(cfg, name, self, gen_addr(cfg, gen_rand() % cfg->functions));
+                sym = objgen_undef(&og, name);
+            }
+            if (!sym || objgen_func_call(&og, sym, 0) < 0)
+                return -1;
+        }
+        if (objgen_func_cold_end(&og, cold) < 0)
+            return -1;
+    }
+
+    if (!index)
+    {
+        // exit_group(count)
+        size_t sym = objgen_undef(&og, "syscall");
+        if (!sym || objgen_func_set_reg(&og, GEN_REG_RAX, 231) < 0 ||
+            objgen_func_call(&og, sym, 0) < 0 || objgen_func_end(&og) < 0)
+            return -1;
+    }
+    else if (tail)
+    {
+        size_t sym = objgen_undef(&og, "instrew_tail_cdecl");
+        if (!sym || objgen_func_set_pc(&og, gen_addr(cfg, first_child + children - 1)) < 0 ||
+            objgen_func_end_tail(&og, sym, 0) < 0)
+            return -1;
+        totals->tails++;
+    }
+    else if (objgen_func_end(&og) < 0)
+    {
+        return -1;
+    }
+
+    size_t size = objgen_finish(&og);
+    totals->bytes += size;
+    totals->relas += og.rela_count;
+
+    char file_name[24];
+    snprintf(file_name, sizeof(file_name), "%lx", (unsigned long)self);
+    return gen_write_file(dir, file_name, buf, size, 0644);
+}
+
+// The guest binary only provides the entry point and the address space; its
+// code is never executed.
+static int
+gen_guest(const struct GenConfig *cfg, const char *dir)
+{
+    // The headers are mapped as part of the segment.
+    size_t headers = sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr);
+    uint64_t seg = (cfg->base - headers) & ~(uint64_t)0xfff;
+    size_t size = cfg->base - seg + 2;
+    uint8_t *buf = calloc(1, size);
+    if (!buf)
+        return -1;
+
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)buf;
+    memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+    ehdr->e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr->e_type = ET_EXEC;
+    ehdr->e_machine = EM_X86_64;
+    ehdr->e_version = EV_CURRENT;
+    ehdr->e_entry = cfg->base;
+    ehdr->e_phoff = sizeof(Elf64_Ehdr);
+    ehdr->e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr->e_phentsize = sizeof(Elf64_Phdr);
+    ehdr->e_phnum = 1;
+
+    Elf64_Phdr *phdr = (Elf64_Phdr *)(buf + sizeof(Elf64_Ehdr));
+    phdr->p_type = PT_LOAD;
+    phdr->p_flags = PF_R | PF_X;
+    phdr->p_vaddr = phdr->p_paddr = seg;
+    phdr->p_filesz = phdr->p_memsz = size;
+    phdr->p_align = 0x1000;
+    buf[size - 2] = 0xeb; // jmp .
+    buf[size - 1] = 0xfe;
+
+    int ret = gen_write_file(dir, "guest", buf, size, 0755);
+    free(buf);
+    return ret;
+}
+
+static bool
+gen_parse_option(struct GenConfig *cfg, const char *opt)
+{
+    static const struct
+    {
+        const char *name;
+        size_t offset;
+        bool is_u64;
+    } options[] = {
+#define GEN_OPTION(name, field, type) \
+    {"-" name "=", offsetof(struct GenConfig, field), sizeof(type) == 8},
+        GEN_OPTION("functions", functions, uint64_t)
+        GEN_OPTION("fanout", fanout, unsigned)
+        GEN_OPTION("cold", cold, unsigned)
+        GEN_OPTION("rodata", rodata, unsigned)
+        GEN_OPTION("refs", refs, unsigned)
+        GEN_OPTION("relative", relative, unsigned)
+        GEN_OPTION("tail", tail, unsigned)
+        GEN_OPTION("base", base, uint64_t)
+        GEN_OPTION("stride", stride, uint64_t)
+        GEN_OPTION("seed", seed, uint64_t)
+#undef GEN_OPTION
+    };
+    for (size_t i = 0; i < sizeof(options) / sizeof(*options); i++)
+    {
+        size_t len = strlen(options[i].name);
+        if (strncmp(opt, options[i].name, len))
+            continue;
+        char *end;
+        unsigned long long value = strtoull(opt + len, &end, 0);
+        if (*end || end == opt + len)
+            return false;
+        char *field = (char *)cfg + options[i].offset;
+        if (options[i].is_u64)
+            *(uint64_t *)field = value;
+        else
+            *(unsigned *)field = value;
+        return true;
+    }
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    struct GenConfig cfg = {
+        .functions = 1000,
+        .fanout = 2,
+        .cold = 4,
+        .rodata = 32,
+        .refs = 2,
+        .relative = 50,
+        .tail = 25,
+        .base = 0x401000,
+        .stride = 0x40,
+        .seed = 1,
+    };
+
+    int i;
+    for (i = 1; i < argc - 1 && argv[i][0] == '-'; i++)
+    {
+        if (!gen_parse_option(&cfg, argv[i]))
+        {
+            fprintf(stderr, "invalid option %s\n", argv[i]);
+            return 2;
+        }
+    }
+    if (i != argc - 1 || !cfg.functions || !cfg.stride || cfg.base < 0x10000 ||
+        cfg.fanout > 1000 || cfg.cold > 1000 || cfg.refs > 1000 ||
+        cfg.rodata > (1u << 20))
+    {
+        fprintf(stderr, "usage: %s [options] <cache dir>\n", argv[0]);
+        return 2;
+    }
+    const char *dir = argv[i];
+    gen_rand_state = cfg.seed ? cfg.seed : 1;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        perror(dir);
+        return 1;
+    }
+    char abs_dir[PATH_MAX];
+    if (!realpath(dir, abs_dir))
+    {
+        perror(dir);
+        return 1;
+    }
+
+    // Enough for the worst case of every instruction sequence.
+    unsigned calls = cfg.fanout + cfg.cold + 1;
+    struct ObjgenLimits limits = {
+        .text_size = 64 + (calls + 1) * 32 + cfg.refs * 8,
+        .rodata_size = cfg.rodata,
+        .syms = calls + 1,
+        .relas = calls + 1 + cfg.refs * 2,
+        .strtab_size = (calls + 1) * OBJGEN_NAME_SIZE,
+    };
+    void *buf = malloc(objgen_size(&limits));
+    if (!buf)
+    {
+        perror("malloc");
+        return 1;
+    }
+
+    struct GenTotals totals = {0};
+    for (uint64_t index = 0; index < cfg.functions; index++)
+    {
+        if (gen_function(&cfg, index, buf, &limits, &totals, abs_dir) < 0)
+        {
+            fprintf(stderr, "failed to generate function %lu\n", (unsigned long)index);
+            return 1;
+        }
+    }
+    free(buf);
+
+    char user_args[PATH_MAX + 16];
+    int len = snprintf(user_args, sizeof(user_args), "1 %s/guest", abs_dir);
+    if (gen_guest(&cfg, abs_dir) < 0 ||
+        gen_write_file(abs_dir, "user_args", user_args, len, 0644) < 0)
+        return 1;
+
+    printf("functions: %lu\n", (unsigned long)cfg.functions);
+    printf("bytes: %lu\n", (unsigned long)totals.bytes);
+    printf("relocations: %lu\n", (unsigned long)totals.relas);
+    printf("tail_calls: %lu\n", (unsigned long)totals.tails);
+    printf("exit_status: %lu\n", (unsigned long)(cfg.functions & 0xff));
+    return 0;
+}
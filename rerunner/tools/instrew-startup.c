@@ -0,0 +1,345 @@
+// Cold-start benchmark of instrew-rerunner.
+//
+// Usage: instrew-startup [options] <rerunner> <cache dir>... [-- runner options]
+//
+// Runs the rerunner repeatedly on every cache, with the page cache dropped
+// before each run (cold) and after an unmeasured warm-up run (warm), and
+// prints the medians of:
+//
+//   wall   wall time of the whole run
+//   guest  time in main before entering the guest
+//   first  time until the first object was loaded
+//   nth    time until the N-th object was loaded (-nth)
+//   rew    time spent loading objects (load.time_total_ns)
+//
+// All times except wall are measured by the runner relative to the start of
+// main and read from its -stats output. Dropping the page cache needs
+// permission to write /proc/sys/vm/drop_caches; otherwise the cache files,
+// the guest and the runner are evicted with POSIX_FADV_DONTNEED, which only
+// affects clean pages not mapped elsewhere.
+//
+// To compare cache sizes and formats, generate one cache per configuration,
+// e.g. with instrew-gen, and pass them all.
+//
+// Options:
+//   -runs=N       measured runs per cache and mode (default 5)
+//   -mode=M       cold, warm or both (default both)
+//   -nth=N        load count for the nth column, a power of ten (default 100)
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STARTUP_MAX_RUNS 1000
+
+enum StartupValue
+{
+    STARTUP_WALL,
+    STARTUP_GUEST,
+    STARTUP_FIRST,
+    STARTUP_NTH,
+    STARTUP_REW,
+    STARTUP_VALUE_COUNT,
+};
+
+struct StartupRun
+{
+    // Nanoseconds, or -1 if not reported.
+    double values[STARTUP_VALUE_COUNT];
+    unsigned long loads;
+};
+
+struct StartupConfig
+{
+    unsigned runs;
+    bool cold;
+    bool warm;
+    // Whether the page cache can be dropped as a whole.
+    bool drop_caches;
+    unsigned long nth;
+    const char *runner;
+    char **runner_opts;
+    int runner_opt_count;
+    char stats_path[32];
+};
+
+static uint64_t
+startup_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool
+startup_drop_caches(void)
+{
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    bool ok = write(fd, "1", 1) == 1;
+    close(fd);
+    return ok;
+}
+
+static void
+startup_evict_file(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static void
+startup_evict(const struct StartupConfig *cfg, const char *dir)
+{
+    if (cfg->drop_caches && startup_drop_caches())
+        return;
+
+    char path[PATH_MAX];
+    DIR *d = opendir(dir);
+    if (d)
+    {
+        struct dirent *ent;
+        while ((ent = readdir(d)))
+        {
+            snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+            startup_evict_file(path);
+        }
+        closedir(d);
+    }
+    startup_evict_file(cfg->runner);
+
+    // The guest binary is the second word of user_args.
+    snprintf(path, sizeof(path), "%s/user_args", dir);
+    FILE *f = fopen(path, "r");
+    if (f)
+    {
+        char guest[PATH_MAX];
+        if (fscanf(f, "%*d %4095s", guest) == 1)
+            startup_evict_file(guest);
+        fclose(f);
+    }
+}
+
+static int
+startup_read_stats(const struct StartupConfig *cfg, struct StartupRun *run)
+{
+    FILE *f = fopen(cfg->stats_path, "r");
+    if (!f)
+        return -1;
+    char nth_key[48];
+    snprintf(nth_key, sizeof(nth_key), "startup.load_%lu_ns", cfg->nth);
+
+    char key[64];
+    unsigned long value;
+    while (fscanf(f, "%63[^:]: %lu\n", key, &value) == 2)
+    {
+        if (!strcmp(key, "startup.guest_ns"))
+            run->values[STARTUP_GUEST] = value;
+        else if (!strcmp(key, "startup.load_1_ns"))
+            run->values[STARTUP_FIRST] = value;
+        else if (!strcmp(key, nth_key))
+            run->values[STARTUP_NTH] = value;
+        else if (!strcmp(key, "load.time_total_ns"))
+            run->values[STARTUP_REW] = value;
+        else if (!strcmp(key, "load.objects"))
+            run->loads = value;
+    }
+    fclose(f);
+    return 0;
+}
+
+static int
+startup_run(const struct StartupConfig *cfg, const char *dir, struct StartupRun *run)
+{
+    for (size_t i = 0; i < STARTUP_VALUE_COUNT; i++)
+        run->values[i] = -1;
+    run->loads = 0;
+
+    char stats_opt[sizeof(cfg->stats_path) + 8];
+    snprintf(stats_opt, sizeof(stats_opt), "-stats=%s", cfg->stats_path);
+    char *argv[cfg->runner_opt_count + 4];
+    int argc = 0;
+    argv[argc++] = (char *)cfg->runner;
+    for (int i = 0; i < cfg->runner_opt_count; i++)
+        argv[argc++] = cfg->runner_opts[i];
+    argv[argc++] = stats_opt;
+    argv[argc++] = (char *)dir;
+    argv[argc] = NULL;
+
+    uint64_t start = startup_now();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        // Keep the output of the guest out of the report.
+        int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (null >= 0)
+            dup2(null, STDOUT_FILENO);
+        execv(cfg->runner, argv);
+        perror(cfg->runner);
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+        {
+            perror("waitpid");
+            return -1;
+        }
+    }
+    run->values[STARTUP_WALL] = startup_now() - start;
+
+    // The exit status belongs to the guest, only crashes are errors.
+    if (WIFSIGNALED(status) || (WIFEXITED(status) && WEXITSTATUS(status) == 127))
+    {
+        fprintf(stderr, "%s: runner failed (status %#x)\n", dir, status);
+        return -1;
+    }
+    return startup_read_stats(cfg, run);
+}
+
+static int
+startup_compare(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void
+startup_report(const char *dir, const char *mode, struct StartupRun *runs, unsigned count)
+{
+    printf("%-32s %-4s", dir, mode);
+    for (size_t v = 0; v < STARTUP_VALUE_COUNT; v++)
+    {
+        double values[STARTUP_MAX_RUNS];
+        unsigned n = 0;
+        for (unsigned i = 0; i < count; i++)
+            if (runs[i].values[v] >= 0)
+                values[n++] = runs[i].values[v];
+        if (!n)
+        {
+            printf(" %10s", "-");
+            continue;
+        }
+        qsort(values, n, sizeof(*values), startup_compare);
+        printf(" %10.3f", values[n / 2] / 1e6);
+    }
+    printf(" %8lu\n", count ? runs[count - 1].loads : 0);
+    fflush(stdout);
+}
+
+static int
+startup_measure(const struct StartupConfig *cfg, const char *dir, bool cold)
+{
+    struct StartupRun runs[STARTUP_MAX_RUNS];
+    if (!cold)
+    {
+        struct StartupRun warmup;
+        if (startup_run(cfg, dir, &warmup) < 0)
+            return -1;
+    }
+    for (unsigned i = 0; i < cfg->runs; i++)
+    {
+        if (cold)
+            startup_evict(cfg, dir);
+        if (startup_run(cfg, dir, &runs[i]) < 0)
+            return -1;
+    }
+    startup_report(dir, cold ? "cold" : "warm", runs, cfg->runs);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct StartupConfig cfg = {
+        .runs = 5,
+        .cold = true,
+        .warm = true,
+        .nth = 100,
+        .stats_path = "/tmp/instrew-startup.XXXXXX",
+    };
+
+    int i;
+    for (i = 1; i < argc && argv[i][0] == '-' && strcmp(argv[i], "--"); i++)
+    {
+        const char *opt = argv[i];
+        if (!strncmp(opt, "-runs=", 6))
+            cfg.runs = strtoul(opt + 6, NULL, 10);
+        else if (!strcmp(opt, "-mode=cold"))
+            cfg.warm = false;
+        else if (!strcmp(opt, "-mode=warm"))
+            cfg.cold = false;
+        else if (!strcmp(opt, "-mode=both"))
+            cfg.cold = cfg.warm = true;
+        else if (!strncmp(opt, "-nth=", 5))
+            cfg.nth = strtoul(opt + 5, NULL, 10);
+        else
+            break;
+    }
+
+    int dirs_start = i + 1, dirs_end = dirs_start;
+    while (dirs_end < argc && strcmp(argv[dirs_end], "--"))
+        dirs_end++;
+    if (dirs_end < argc)
+    {
+        cfg.runner_opts = argv + dirs_end + 1;
+        cfg.runner_opt_count = argc - dirs_end - 1;
+    }
+    unsigned long nth = cfg.nth;
+    while (nth >= 10 && nth % 10 == 0)
+        nth /= 10;
+    if (i >= argc || argv[i][0] == '-' || dirs_start >= dirs_end || !cfg.runs ||
+        cfg.runs > STARTUP_MAX_RUNS || nth != 1)
+    {
+        fprintf(stderr, "usage: %s [-runs=N] [-mode=cold|warm|both] [-nth=N] "
+                        "<rerunner> <cache dir>... [-- runner options]\n", argv[0]);
+        return 2;
+    }
+    cfg.runner = argv[i];
+
+    int fd = mkstemp(cfg.stats_path);
+    if (fd < 0)
+    {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    if (cfg.cold)
+    {
+        cfg.drop_caches = startup_drop_caches();
+        printf("# page cache: %s\n", cfg.drop_caches ? "drop_caches" : "fadvise");
+    }
+    char nth_name[32];
+    snprintf(nth_name, sizeof(nth_name), "load%lu_ms", cfg.nth);
+    printf("%-32s %-4s %10s %10s %10s %10s %10s %8s\n", "# cache", "mode", "wall_ms",
+           "guest_ms", "first_ms", nth_name, "rew_ms", "loads");
+    int ret = 0;
+    for (int d = dirs_start; d < dirs_end && !ret; d++)
+    {
+        if ((cfg.cold && startup_measure(&cfg, argv[d], true) < 0) ||
+            (cfg.warm && startup_measure(&cfg, argv[d], false) < 0))
+            ret = 1;
+    }
+    unlink(cfg.stats_path);
+    return ret;
+}
@@ -0,0 +1,172 @@
+// Reader for the live statistics of a running instrew-rerunner (-livestats).
+//
+// Usage: instrew-stat <pid> [interval in seconds]
+//        instrew-stat <pid> ctl <command>
+//
+// Without an interval, print a snapshot of all counters. Otherwise, print one
+// line of rates per interval until the runner exits. The second form sends a
+// command to a runner started with -control.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "livestats-shm.h"
+
+// Mirrors enum ControlCommand in control.h, indexed by value.
+static const char *const control_commands[] = {
+    NULL, "stats", "sample-start", "sample-stop", "count-start", "count-stop",
+    "profile-flush", "snapshot", "trace",
+};
+
+static int
+send_command(unsigned long pid, const char *name)
+{
+    for (size_t i = 1; i < sizeof(control_commands) / sizeof(*control_commands); i++)
+    {
+        if (strcmp(name, control_commands[i]))
+            continue;
+        // The runner reserves the last real-time signal for commands.
+        if (sigqueue(pid, SIGRTMAX, (union sigval){.sival_int = i}) < 0)
+        {
+            perror("sigqueue");
+            return 1;
+        }
+        return 0;
+    }
+    fprintf(stderr, "unknown command %s, expected one of:", name);
+    for (size_t i = 1; i < sizeof(control_commands) / sizeof(*control_commands); i++)
+        fprintf(stderr, " %s", control_commands[i]);
+    fprintf(stderr, "\n");
+    return 2;
+}
+
+static int
+read_snapshot(struct LivestatsShm *shm, struct LivestatsShm *out)
+{
+    for (unsigned tries = 0; tries < 1000; tries++)
+    {
+        uint32_t seq = atomic_load_explicit(&shm->seq, memory_order_acquire);
+        if (seq & 1)
+            continue;
+        memcpy(out, shm, sizeof(*out));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&shm->seq, memory_order_relaxed) == seq)
+            return 0;
+    }
+    return -EAGAIN;
+}
+
+static void
+print_snapshot(const struct LivestatsShm *s)
+{
+    double elapsed = (s->time_update - s->time_start) / 1e9;
+    // Misses also count resolves for patching.
+    uint64_t hits = s->dispatches > s->tlb_misses ? s->dispatches - s->tlb_misses : 0;
+    printf("pid: %u%s\n", s->pid, s->exited ? " (exited)" : "");
+    printf("uptime_s: %.1f\n", elapsed);
+    printf("updates: %lu\n", (unsigned long)s->updates);
+    printf("dispatch.count: %lu\n", (unsigned long)s->dispatches);
+    printf("dispatch.tlb_hit_rate: %.4f\n",
+           s->dispatches ? (double)hits / s->dispatches : 0.0);
+    printf("dispatch.tlb_misses: %lu\n", (unsigned long)s->tlb_misses);
+    printf("syscall.count: %lu\n", (unsigned long)s->syscalls);
+    printf("load.resolves: %lu\n", (unsigned long)s->resolves);
+    printf("load.objects: %lu\n", (unsigned long)s->loads);
+    printf("load.bytes: %lu\n", (unsigned long)s->load_bytes);
+    printf("load.patches: %lu\n", (unsigned long)s->patches);
+    printf("rtld.objects: %lu\n", (unsigned long)s->rtld_objects);
+    printf("rtld.functions: %lu\n", (unsigned long)s->rtld_functions);
+    printf("rtld.code_bytes: %lu\n", (unsigned long)s->rtld_code_bytes);
+    printf("rtld.rodata_bytes: %lu\n", (unsigned long)s->rtld_rodata_bytes);
+    printf("mem.code.used: %lu\n", (unsigned long)s->mem_code_used);
+    printf("mem.code.committed: %lu\n", (unsigned long)s->mem_code_committed);
+    printf("mem.rodata.used: %lu\n", (unsigned long)s->mem_rodata_used);
+    printf("mem.rodata.committed: %lu\n", (unsigned long)s->mem_rodata_committed);
+    printf("mem.data.used: %lu\n", (unsigned long)s->mem_data_used);
+    printf("mem.data.committed: %lu\n", (unsigned long)s->mem_data_committed);
+}
+
+static void
+print_rates(const struct LivestatsShm *prev, const struct LivestatsShm *cur)
+{
+    double dt = (cur->time_update - prev->time_update) / 1e9;
+    if (dt <= 0)
+        return;
+    uint64_t dispatches = cur->dispatches - prev->dispatches;
+    uint64_t misses = cur->tlb_misses - prev->tlb_misses;
+    printf("%9.1f %12.0f %8.4f %10.0f %10.0f %8lu %10lu\n",
+           (cur->time_update - cur->time_start) / 1e9, dispatches / dt,
+           dispatches ? (double)(dispatches - misses) / dispatches : 0.0,
+           misses / dt, (cur->syscalls - prev->syscalls) / dt,
+           (unsigned long)cur->loads, (unsigned long)cur->mem_code_used);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 4 || (argc == 4 && strcmp(argv[2], "ctl")))
+    {
+        fprintf(stderr, "usage: %s <pid> [interval]\n"
+                        "       %s <pid> ctl <command>\n", argv[0], argv[0]);
+        return 2;
+    }
+    unsigned long pid = strtoul(argv[1], NULL, 10);
+    if (argc == 4)
+        return send_command(pid, argv[3]);
+    unsigned interval = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+
+    char path[64];
+    snprintf(path, sizeof(path), "%s%lu", LIVESTATS_SHM_PREFIX, pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror(path);
+        return 1;
+    }
+    struct LivestatsShm *shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+    if (memcmp(shm->magic, LIVESTATS_SHM_MAGIC, sizeof(shm->magic)) != 0 ||
+        shm->version != LIVESTATS_SHM_VERSION || shm->size < sizeof(*shm))
+    {
+        fprintf(stderr, "%s: unsupported format\n", path);
+        return 1;
+    }
+
+    struct LivestatsShm prev, cur;
+    if (read_snapshot(shm, &cur) < 0)
+    {
+        fprintf(stderr, "%s: no consistent snapshot\n", path);
+        return 1;
+    }
+    if (!cur.exited && kill(cur.pid, 0) < 0 && errno == ESRCH)
+        fprintf(stderr, "warning: process %u is gone, values are stale\n", cur.pid);
+    if (!interval)
+    {
+        print_snapshot(&cur);
+        return 0;
+    }
+
+    printf("%9s %12s %8s %10s %10s %8s %10s\n", "time_s", "dispatch/s",
+           "tlb_hit", "misses/s", "syscall/s", "loads", "code");
+    while (!cur.exited && !(kill(cur.pid, 0) < 0 && errno == ESRCH))
+    {
+        prev = cur;
+        sleep(interval);
+        if (read_snapshot(shm, &cur) < 0)
+            continue;
+        print_rates(&prev, &cur);
+        fflush(stdout);
+    }
+    return 0;
+}
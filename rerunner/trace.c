@@ -0,0 +1,162 @@
+#include <stdatomic.h>
+
+#include "common.h"
+#include "memory.h"
+#include "stats.h"
+#include "symbols.h"
+#include "trace.h"
+
+static const char *trace_path;
+static uint64_t trace_epoch;
+static struct TraceBuffer *_Atomic trace_buffers;
+
+static const char *const trace_event_names[] = {
+    [TRACE_MISS] = "miss",
+    [TRACE_LOAD] = "load",
+    [TRACE_PATCH] = "patch",
+    [TRACE_SYSCALL] = "syscall",
+    [TRACE_SIGNAL] = "signal",
+    [TRACE_EVICT] = "evict",
+    [TRACE_PRELOAD] = "preload",
+};
+
+int trace_init(const char *path)
+{
+    trace_path = path;
+    trace_epoch = stats_now();
+    return 0;
+}
+
+struct TraceBuffer *trace_buffer_create(void)
+{
+    struct TraceBuffer *buffer = mem_alloc_data(sizeof(*buffer), _Alignof(struct TraceBuffer));
+    if (BAD_ADDR(buffer))
+        return buffer;
+    size_t size = sizeof(struct TraceRecord) << TRACE_BUFFER_BITS;
+    struct TraceRecord *records = mem_alloc_data(size, getpagesize());
+    if (BAD_ADDR(records))
+        return (void *)records;
+    buffer->records = records;
+    buffer->mask = (1ul << TRACE_BUFFER_BITS) - 1;
+    buffer->head = 0;
+    buffer->tid = gettid();
+
+    buffer->next = atomic_load_explicit(&trace_buffers, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&trace_buffers, &buffer->next, buffer,
+                                                  memory_order_release, memory_order_relaxed))
+        ;
+    return buffer;
+}
+
+// Format a timestamp in microseconds with three decimals, as Chrome expects.
+static void
+trace_format_us(char *buf, size_t size, uint64_t ns)
+{
+    unsigned frac = ns % 1000;
+    snprintf(buf, size, "%lu.%c%c%c", (unsigned long)(ns / 1000),
+             '0' + frac / 100, '0' + frac / 10 % 10, '0' + frac % 10);
+}
+
+// Copy src into dst as the contents of a JSON string. Paths and symbol names
+// can contain quotes, backslashes and control characters.
+static void
+trace_escape_json(char *dst, size_t size, const char *src)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t len = 0;
+    for (; *src; src++)
+    {
+        unsigned char c = *src;
+        char esc[7] = {'\\', c};
+        size_t esc_len = 2;
+        if (c < 0x20)
+        {
+            memcpy(esc + 1, "u00", 3);
+            esc[4] = hex[c >> 4];
+            esc[5] = hex[c & 0xf];
+            esc_len = 6;
+        }
+        else if (c != '"' && c != '\\')
+        {
+            esc[0] = c;
+            esc_len = 1;
+        }
+        if (len + esc_len >= size)
+            break;
+        memcpy(dst + len, esc, esc_len);
+        len += esc_len;
+    }
+    dst[len] = 0;
+}
+
+static void
+trace_write_record(int fd, int pid, int tid, const struct TraceRecord *rec)
+{
+    char ts[32], dur[32];
+    uint64_t start = rec->start > trace_epoch ? rec->start - trace_epoch : 0;
+    trace_format_us(ts, sizeof(ts), start);
+    trace_format_us(dur, sizeof(dur), rec->end - rec->start);
+    const char *name = trace_event_names[rec->event];
+
+    switch (rec->event)
+    {
+    case TRACE_SIGNAL:
+        dprintf(fd, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%s,"
+                    "\"pid\":%u,\"tid\":%u,\"args\":{\"signal\":%lu}}",
+                name, ts, pid, tid, rec->arg);
+        break;
+    case TRACE_SYSCALL:
+        dprintf(fd, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%s,\"dur\":%s,"
+                    "\"pid\":%u,\"tid\":%u,\"args\":{\"nr\":%lu}}",
+                name, ts, dur, pid, tid, rec->arg);
+        break;
+    case TRACE_PRELOAD:
+        dprintf(fd, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%s,\"dur\":%s,"
+                    "\"pid\":%u,\"tid\":%u,\"args\":{\"objects\":%lu}}",
+                name, ts, dur, pid, tid, rec->arg);
+        break;
+    default:
+    {
+        // Guest address, symbolized if possible.
+        char sym[128] = "";
+        char sym_json[6 * sizeof(sym)];
+        symbols_format(rec->arg, sym, sizeof(sym));
+        trace_escape_json(sym_json, sizeof(sym_json), sym);
+        const char *ph = rec->event == TRACE_EVICT ? "i\",\"s\":\"t" : "X";
+        dprintf(fd, ",\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%s,\"dur\":%s,"
+                    "\"pid\":%u,\"tid\":%u,\"args\":{\"addr\":\"0x%lx\",\"sym\":\"%s\"}}",
+                name, ph, ts, dur, pid, tid, rec->arg, sym_json);
+        break;
+    }
+    }
+}
+
+int trace_write(void)
+{
+    if (!trace_path)
+        return 0;
+    int fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return fd;
+
+    int pid = getpid();
+    dprintf(fd, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+                "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,"
+                "\"args\":{\"name\":\"instrew-rerunner\"}}",
+            pid);
+    struct TraceBuffer *buffer = atomic_load_explicit(&trace_buffers, memory_order_acquire);
+    for (; buffer; buffer = buffer->next)
+    {
+        uint64_t head = buffer->head;
+        uint64_t size = buffer->mask + 1;
+        uint64_t first = head > size ? head - size : 0;
+        dprintf(fd, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,"
+                    "\"args\":{\"name\":\"guest %u (%lu events dropped)\"}}",
+                pid, buffer->tid, buffer->tid, first);
+        for (uint64_t i = first; i < head; i++)
+            trace_write_record(fd, pid, buffer->tid, &buffer->records[i & buffer->mask]);
+    }
+    dprintf(fd, "\n]}\n");
+    close(fd);
+    return 0;
+}
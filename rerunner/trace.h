@@ -0,0 +1,59 @@
+#ifndef _INSTREW_RUNNER_TRACE_H
+#define _INSTREW_RUNNER_TRACE_H
+
+#include "common.h"
+
+// Event tracer: every thread records fixed-size events into its own ring
+// buffer in the data arena, overwriting the oldest ones. The buffers are
+// written as Chrome trace JSON (chrome://tracing, ui.perfetto.dev) at exit.
+// Call sites check CpuState::trace, which is NULL when tracing is disabled.
+#define TRACE_FILE_NAME "trace.json"
+#define TRACE_BUFFER_BITS 15
+
+enum TraceEvent
+{
+    TRACE_MISS,    // resolve_func; arg: guest address
+    TRACE_LOAD,    // object loaded from the cache; arg: guest address
+    TRACE_PATCH,   // arg: guest address
+    TRACE_SYSCALL, // arg: guest syscall number
+    TRACE_SIGNAL,  // instant, signal delivered to the guest; arg: signal
+    TRACE_EVICT,   // instant, quick TLB entry replaced; arg: old address
+    TRACE_PRELOAD, // arg: number of loaded objects
+};
+
+struct TraceRecord
+{
+    uint64_t start; // ns, CLOCK_MONOTONIC
+    uint64_t end;
+    uint64_t arg;
+    uint32_t event;
+    uint32_t _pad;
+};
+
+struct TraceBuffer
+{
+    struct TraceRecord *records;
+    size_t mask;
+    uint64_t head; // number of records ever added
+    int tid;
+    struct TraceBuffer *next;
+};
+
+int trace_init(const char *path);
+// Allocate the buffer of a new thread; returns BAD_ADDR on failure.
+struct TraceBuffer *trace_buffer_create(void);
+// Write all buffers. Can be called repeatedly, e.g. on request.
+int trace_write(void);
+
+static inline void
+trace_add(struct TraceBuffer *buffer, enum TraceEvent event, uint64_t start,
+          uint64_t end, uint64_t arg)
+{
+    struct TraceRecord *rec = &buffer->records[buffer->head++ & buffer->mask];
+    rec->start = start;
+    rec->end = end;
+    rec->arg = arg;
+    rec->event = event;
+}
+
+#endif